@@ -0,0 +1,361 @@
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <grpcpp/grpcpp.h>
+
+#include "dfslib-clientnode-p2.h"
+#include "dfslib-histogram-p2.h"
+#include "dfslib-log-p2.h"
+
+using grpc::StatusCode;
+using std::chrono::steady_clock;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+using dfs_service::DFSService;
+
+/**
+ * Heap allocations made by the calling thread. Every allocation through the
+ * global operator new is counted, so an operation's delta shows the C++ heap
+ * traffic of the client streaming path; gRPC core allocates with malloc and
+ * is not included.
+ */
+static thread_local uint64_t thread_allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++thread_allocations;
+    void* block = malloc(size ? size : 1);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept {
+    free(block);
+}
+
+/** Client operations measured by the benchmark **/
+enum BenchOp { OP_STORE = 0, OP_FETCH, OP_LIST, OP_STAT, OP_COUNT };
+
+static const char* OP_NAMES[OP_COUNT] = {"store", "fetch", "list", "stat"};
+
+struct BenchConfig {
+    string workload = "mixed";
+    string server_bin = "./bin/dfs-server-p2";
+    string output_path;
+    string address = "127.0.0.1:42001";
+    int clients = 4;
+    int duration_s = 10;
+    int deadline_ms = 10000;
+    int channels = 0;
+    long small_size = 4 * 1024;
+    long large_size = 64L * 1024 * 1024;
+    int hot_files = 1;
+};
+
+/** Latency covers completed operations only; refused ones are counted by cause **/
+struct OpStats {
+    LatencyHistogram latency;
+    std::atomic<uint64_t> lock_held{0};
+    std::atomic<uint64_t> shed{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> allocations{0};
+};
+
+static void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  -w workload     small | large | mixed | contention (default mixed)\n"
+              << "  -c clients      simulated clients (default 4)\n"
+              << "  -d seconds      run time (default 10)\n"
+              << "  -s bytes        small file size (default 4096)\n"
+              << "  -l bytes        large file size (default 64MiB)\n"
+              << "  -h files        hot files for the contention workload (default 1)\n"
+              << "  -p channels     client channel pool size, 0 for a single channel (default 0)\n"
+              << "  -t ms           per-call deadline (default 10000)\n"
+              << "  -a address      address for the local server (default 127.0.0.1:42001)\n"
+              << "  -b path         server binary (default ./bin/dfs-server-p2)\n"
+              << "  -o path         write JSON results to path instead of stdout\n";
+}
+
+static string make_temp_dir(const string& prefix) {
+    string pattern = "/tmp/" + prefix + "XXXXXX";
+    vector<char> buffer(pattern.begin(), pattern.end());
+    buffer.push_back('\0');
+    if (!mkdtemp(buffer.data())) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    return string(buffer.data()) + "/";
+}
+
+static void write_random_file(const string& path, long size, std::mt19937_64& rng) {
+    ofstream ofs(path, ios::binary | ios::trunc);
+    vector<uint64_t> block(8192);
+    for (long written = 0; written < size; ) {
+        for (uint64_t& word : block) {
+            word = rng();
+        }
+        long length = std::min<long>(size - written, block.size() * sizeof(uint64_t));
+        ofs.write(reinterpret_cast<const char*>(block.data()), length);
+        written += length;
+    }
+}
+
+/** Server-side allocation and chunk totals, read through GetStats **/
+struct ServerCounters {
+    uint64_t allocations = 0;
+    uint64_t chunks = 0;
+};
+
+static bool read_server_counters(DFSService::Stub* stub, ServerCounters* counters) {
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+    Blank request;
+    StatsReply reply;
+    if (!stub->GetStats(&context, request, &reply).ok() || !reply.counts_allocations()) {
+        return false;
+    }
+    counters->allocations = reply.heap_allocations();
+    counters->chunks = 0;
+    for (const RpcStats& rpc : reply.rpcs()) {
+        counters->chunks += rpc.chunks();
+    }
+    return true;
+}
+
+static pid_t start_server(const BenchConfig& config, const string& mount_path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(config.server_bin.c_str(), config.server_bin.c_str(),
+              "-a", config.address.c_str(), "-m", mount_path.c_str(), (char*) nullptr);
+        perror("execl");
+        _exit(EXIT_FAILURE);
+    }
+
+    std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(config.address, grpc::InsecureChannelCredentials());
+    if (!channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(10))) {
+        std::cerr << "Server at " << config.address << " did not come up" << std::endl;
+        kill(pid, SIGTERM);
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+template <typename Op>
+static void timed(OpStats& stats, const DFSClientNodeP2& client, long bytes, Op op) {
+    uint64_t allocations_before = thread_allocations;
+    uint64_t shed_before = client.ShedCalls();
+    steady_clock::time_point start = steady_clock::now();
+    StatusCode result = op();
+    int64_t elapsed_us = duration_cast<microseconds>(steady_clock::now() - start).count();
+    stats.allocations.fetch_add(thread_allocations - allocations_before, std::memory_order_relaxed);
+
+    // A refused call returns quickly, so counting it as a completion would flatter both rate and latency
+    if (result == StatusCode::RESOURCE_EXHAUSTED) {
+        if (client.ShedCalls() != shed_before) {
+            stats.shed.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            stats.lock_held.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+    // Unchanged files are an expected outcome, not a failure; failures return early or late and stay out of the histogram
+    if (result != StatusCode::OK && result != StatusCode::ALREADY_EXISTS) {
+        stats.errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    stats.latency.Record(elapsed_us);
+    if (result == StatusCode::OK) {
+        stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+static void run_client(const BenchConfig& config, int id, const string& mount_path,
+                       steady_clock::time_point stop, OpStats* stats) {
+    DFSClientNodeP2 client;
+    client.SetMountPath(mount_path);
+    client.SetDeadlineTimeout(config.deadline_ms);
+    client.CreateStub(config.address);
+    if (config.channels > 0) {
+        ChannelPoolOptions options;
+        options.channels_per_target = config.channels;
+        client.ConfigureChannelPool(config.address, options);
+    }
+
+    std::mt19937_64 rng(id * 7919 + 1);
+    std::uniform_int_distribution<int> percent(0, 99);
+    string own_file = "bench-" + to_string(id);
+    long own_size = config.workload == "large" ? config.large_size : config.small_size;
+    write_random_file(mount_path + own_file, own_size, rng);
+    client.Store(own_file);
+
+    std::map<std::string, int> listing;
+    for (long round = 0; steady_clock::now() < stop; ++round) {
+        if (config.workload == "small") {
+            // Many distinct small files: exercises locking and metadata more than bandwidth
+            string name = own_file + "-" + to_string(round % 256);
+            write_random_file(mount_path + name, config.small_size, rng);
+            timed(stats[OP_STORE], client, config.small_size, [&] { return client.Store(name); });
+            unlink((mount_path + name).c_str());
+            timed(stats[OP_FETCH], client, config.small_size, [&] { return client.Fetch(name); });
+        } else if (config.workload == "large") {
+            write_random_file(mount_path + own_file, config.large_size, rng);
+            timed(stats[OP_STORE], client, config.large_size, [&] { return client.Store(own_file); });
+            unlink((mount_path + own_file).c_str());
+            timed(stats[OP_FETCH], client, config.large_size, [&] { return client.Fetch(own_file); });
+        } else if (config.workload == "contention") {
+            // Every client rewrites the same few files, so most time goes to the write lock
+            string name = "hot-" + to_string(round % config.hot_files);
+            write_random_file(mount_path + name, config.small_size, rng);
+            timed(stats[OP_STORE], client, config.small_size, [&] { return client.Store(name); });
+        } else {
+            int roll = percent(rng);
+            if (roll < 30) {
+                write_random_file(mount_path + own_file, config.small_size, rng);
+                timed(stats[OP_STORE], client, config.small_size, [&] { return client.Store(own_file); });
+            } else if (roll < 70) {
+                unlink((mount_path + own_file).c_str());
+                timed(stats[OP_FETCH], client, config.small_size, [&] { return client.Fetch(own_file); });
+            } else if (roll < 85) {
+                listing.clear();
+                timed(stats[OP_LIST], client, 0, [&] { return client.List(&listing, false); });
+            } else {
+                timed(stats[OP_STAT], client, 0, [&] { return client.Stat(own_file, nullptr); });
+            }
+        }
+    }
+}
+
+static void report(std::ostream& out, const BenchConfig& config, double elapsed_s, OpStats* stats,
+                   const ServerCounters* server) {
+    out << "{\"workload\":\"" << config.workload << "\",\"clients\":" << config.clients
+        << ",\"channels\":" << config.channels << ",\"elapsed_s\":" << elapsed_s << ",\"ops\":{";
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        const OpStats& op_stats = stats[op];
+        uint64_t attempts = op_stats.latency.Count() + op_stats.lock_held.load() + op_stats.shed.load();
+        if (attempts == 0) {
+            continue;
+        }
+        out << (first ? "" : ",") << "\"" << OP_NAMES[op] << "\":{"
+            << "\"count\":" << op_stats.latency.Count()
+            << ",\"lock_held\":" << op_stats.lock_held.load()
+            << ",\"shed\":" << op_stats.shed.load()
+            << ",\"errors\":" << op_stats.errors.load()
+            << ",\"ops_per_s\":" << op_stats.latency.Count() / elapsed_s
+            << ",\"mb_per_s\":" << op_stats.bytes.load() / elapsed_s / (1024 * 1024)
+            << ",\"allocs_per_op\":" << static_cast<double>(op_stats.allocations.load()) / attempts
+            << ",\"allocs_per_mib\":"
+            << (op_stats.bytes.load() ? op_stats.allocations.load() * 1048576.0 / op_stats.bytes.load() : 0)
+            << ",\"mean_us\":" << op_stats.latency.Mean()
+            << ",\"p50_us\":" << op_stats.latency.Percentile(50)
+            << ",\"p99_us\":" << op_stats.latency.Percentile(99)
+            << ",\"p999_us\":" << op_stats.latency.Percentile(99.9)
+            << ",\"max_us\":" << op_stats.latency.Max() << "}";
+        first = false;
+    }
+    out << "}";
+    if (server) {
+        out << ",\"server\":{\"allocs\":" << server->allocations << ",\"chunks\":" << server->chunks
+            << ",\"allocs_per_chunk\":"
+            << (server->chunks ? static_cast<double>(server->allocations) / server->chunks : 0) << "}";
+    }
+    out << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    int option;
+    while ((option = getopt(argc, argv, "w:c:d:s:l:h:p:t:a:b:o:")) != -1) {
+        switch (option) {
+            case 'w': config.workload = optarg; break;
+            case 'c': config.clients = atoi(optarg); break;
+            case 'd': config.duration_s = atoi(optarg); break;
+            case 's': config.small_size = atol(optarg); break;
+            case 'l': config.large_size = atol(optarg); break;
+            case 'h': config.hot_files = std::max(1, atoi(optarg)); break;
+            case 'p': config.channels = atoi(optarg); break;
+            case 't': config.deadline_ms = atoi(optarg); break;
+            case 'a': config.address = optarg; break;
+            case 'b': config.server_bin = optarg; break;
+            case 'o': config.output_path = optarg; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    if (config.workload != "small" && config.workload != "large" &&
+        config.workload != "mixed" && config.workload != "contention") {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    DFS_LOG_LEVEL = LL_ERROR;
+    string server_mount = make_temp_dir("dfs-bench-server-");
+    pid_t server_pid = start_server(config, server_mount);
+
+    std::unique_ptr<OpStats[]> stats(new OpStats[OP_COUNT]);
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point stop = start + std::chrono::seconds(config.duration_s);
+
+    vector<std::thread> clients;
+    vector<string> client_mounts;
+    for (int id = 0; id < config.clients; ++id) {
+        client_mounts.push_back(make_temp_dir("dfs-bench-client-"));
+        clients.emplace_back(run_client, std::cref(config), id, client_mounts.back(), stop, stats.get());
+    }
+
+    // Server counters are sampled after a warm-up, so filling its message pools is not counted
+    std::unique_ptr<DFSService::Stub> stats_stub =
+        DFSService::NewStub(grpc::CreateChannel(config.address, grpc::InsecureChannelCredentials()));
+    std::this_thread::sleep_until(start + std::chrono::milliseconds(config.duration_s * 200));
+    ServerCounters server_before, server_after;
+    bool have_server = read_server_counters(stats_stub.get(), &server_before);
+
+    for (std::thread& client : clients) {
+        client.join();
+    }
+    double elapsed_s = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    have_server = have_server && read_server_counters(stats_stub.get(), &server_after);
+    server_after.allocations -= server_before.allocations;
+    server_after.chunks -= server_before.chunks;
+
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, nullptr, 0);
+
+    if (config.output_path.empty()) {
+        report(std::cout, config, elapsed_s, stats.get(), have_server ? &server_after : nullptr);
+    } else {
+        ofstream out(config.output_path, ios::app);
+        report(out, config, elapsed_s, stats.get(), have_server ? &server_after : nullptr);
+    }
+
+    dfs_log_flush();
+    for (const string& mount : client_mounts) {
+        system(("rm -rf '" + mount + "'").c_str());
+    }
+    system(("rm -rf '" + server_mount + "'").c_str());
+    return EXIT_SUCCESS;
+}
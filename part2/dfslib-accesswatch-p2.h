@@ -0,0 +1,91 @@
+#ifndef DFSLIB_ACCESSWATCH_P2_H
+#define DFSLIB_ACCESSWATCH_P2_H
+
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <functional>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+/**
+ * Reports opens and completed writes in a directory through its own inotify
+ * instance.
+ *
+ * The sync watcher only listens for changes. This one also sees reads
+ * (IN_OPEN), which the prefetcher needs in order to learn. Events are passed
+ * to the callback on a dedicated thread. The thread sleeps in poll() until
+ * an event arrives or the watcher is destroyed.
+ */
+class AccessWatcher {
+
+public:
+    typedef std::function<void(const std::string&, uint32_t)> Callback;
+
+private:
+    Callback callback;
+    int inotify_fd = -1;
+    int wake_pipe[2] = {-1, -1};
+    std::thread worker;
+
+    void Run() {
+        alignas(struct inotify_event) char buffer[4096];
+        struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents != 0) {
+                return;
+            }
+
+            ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < length; ) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+                if (event->len > 0) {
+                    callback(event->name, event->mask);
+                }
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+
+public:
+    AccessWatcher(const std::string& directory, Callback callback) : callback(callback) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0 || pipe2(wake_pipe, O_CLOEXEC) != 0 ||
+            inotify_add_watch(inotify_fd, directory.c_str(), IN_OPEN | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            return;
+        }
+        worker = std::thread(&AccessWatcher::Run, this);
+    }
+
+    AccessWatcher(const AccessWatcher&) = delete;
+    AccessWatcher& operator=(const AccessWatcher&) = delete;
+
+    ~AccessWatcher() {
+        if (worker.joinable()) {
+            char stop = 0;
+            while (write(wake_pipe[1], &stop, 1) < 0 && errno == EINTR) {}
+            worker.join();
+        }
+        for (int fd : {inotify_fd, wake_pipe[0], wake_pipe[1]}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    /** False if inotify could not be set up, in which case no events are reported **/
+    bool Watching() const {
+        return worker.joinable();
+    }
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef DFSLIB_ADMISSION_P2_H
+#define DFSLIB_ADMISSION_P2_H
+
+#include <mutex>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+/** Limits applied by the AdmissionController; 0 disables a limit **/
+struct AdmissionOptions {
+    /** Server threads handling synchronous calls **/
+    int workers = 16;
+
+    /** Transfers (uploads, downloads, ranged reads) running at once **/
+    int max_concurrent_transfers = 32;
+
+    /** Bytes of uploads admitted but not yet written to disk **/
+    long max_buffered_bytes = 256L * 1024 * 1024;
+
+    /** Longest estimated queueing delay a call is admitted with **/
+    int max_queue_delay_ms = 2000;
+};
+
+/**
+ * Early load shedding for the server.
+ *
+ * Keeps an EWMA of service time per call class and estimates the queueing
+ * delay from the number of calls in flight. Transfers of known size are
+ * estimated from a separate EWMA of the time per byte, so one slow large
+ * upload does not make every small one look too slow for its deadline. A
+ * call is rejected up front when it would exceed the transfer or
+ * buffered-byte caps, when the estimated delay is over the limit, or when its
+ * deadline would pass before it could finish. Only completed calls feed the
+ * estimates, so each rejection based on them decays them as well; otherwise
+ * an estimate that grew too large would keep rejecting every call forever.
+ * Rejections carry a retry-after hint sized to the estimated delay.
+ */
+class AdmissionController {
+
+public:
+    enum CallClass { METADATA = 0, TRANSFER = 1 };
+
+    /** Admission decision; releases the call's share of capacity when destroyed **/
+    class Ticket {
+    private:
+        AdmissionController* controller;
+        CallClass call_class;
+        long bytes;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::milliseconds retry_after;
+        std::string reason;
+
+        friend class AdmissionController;
+
+    public:
+        Ticket(AdmissionController* controller, CallClass call_class, long bytes)
+            : controller(controller), call_class(call_class), bytes(bytes),
+              start(std::chrono::steady_clock::now()), retry_after(0) {}
+
+        Ticket(Ticket&& other) noexcept
+            : controller(other.controller), call_class(other.call_class), bytes(other.bytes),
+              start(other.start), retry_after(other.retry_after), reason(std::move(other.reason)) {
+            other.controller = nullptr;
+        }
+
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+
+        ~Ticket() {
+            if (controller) {
+                controller->Release(*this);
+            }
+        }
+
+        bool Admitted() const { return controller != nullptr; }
+        std::chrono::milliseconds RetryAfter() const { return retry_after; }
+        const std::string& Reason() const { return reason; }
+    };
+
+private:
+    AdmissionOptions options;
+
+    int in_flight = 0;
+    int transfers = 0;
+    long buffered_bytes = 0;
+
+    /** Smoothed service time per call class, in milliseconds **/
+    double service_ms[2] = {1.0, 50.0};
+
+    /** Smoothed transfer time per byte, 0 until a transfer of known size completes **/
+    double transfer_ms_per_byte = 0;
+
+    /** Factor applied to the estimates on each rejection they caused **/
+    static constexpr double REJECT_DECAY = 0.9;
+    static constexpr double MIN_SERVICE_MS = 1.0;
+
+    double EstimateLocked(CallClass call_class, long bytes) const {
+        if (call_class == TRANSFER && bytes > 0 && transfer_ms_per_byte > 0) {
+            return service_ms[METADATA] + transfer_ms_per_byte * bytes;
+        }
+        return service_ms[call_class];
+    }
+
+    void DecayLocked(CallClass call_class) {
+        service_ms[call_class] *= REJECT_DECAY;
+        if (service_ms[call_class] < MIN_SERVICE_MS) {
+            service_ms[call_class] = MIN_SERVICE_MS;
+        }
+        if (call_class == TRANSFER) {
+            transfer_ms_per_byte *= REJECT_DECAY;
+        }
+    }
+
+    std::mutex admission_m;
+
+    Ticket Reject(CallClass call_class, double delay_ms, const std::string& reason) {
+        Ticket ticket(nullptr, call_class, 0);
+        ticket.retry_after = std::chrono::milliseconds(std::max(10L, static_cast<long>(delay_ms)));
+        ticket.reason = reason;
+        return ticket;
+    }
+
+    void Release(const Ticket& ticket) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - ticket.start;
+        std::lock_guard<std::mutex> lock(admission_m);
+        in_flight--;
+        if (ticket.call_class == TRANSFER) {
+            transfers--;
+            buffered_bytes -= ticket.bytes;
+            if (ticket.bytes > 0) {
+                double sample = elapsed.count() / ticket.bytes;
+                transfer_ms_per_byte = transfer_ms_per_byte == 0 ? sample : 0.9 * transfer_ms_per_byte + 0.1 * sample;
+            }
+        }
+        service_ms[ticket.call_class] = 0.9 * service_ms[ticket.call_class] + 0.1 * elapsed.count();
+    }
+
+public:
+    explicit AdmissionController(const AdmissionOptions& options = AdmissionOptions()) : options(options) {}
+
+    /** Admits a call expected to buffer `bytes`, which must finish by `deadline` **/
+    Ticket Admit(CallClass call_class, std::chrono::system_clock::time_point deadline, long bytes = 0) {
+        std::lock_guard<std::mutex> lock(admission_m);
+
+        // Calls beyond the worker count wait for a thread; each wave takes one average service time
+        int queued = std::max(0, in_flight - options.workers + 1);
+        double queue_delay_ms = queued * service_ms[call_class] / std::max(1, options.workers);
+        double estimate_ms = EstimateLocked(call_class, bytes);
+
+        if (call_class == TRANSFER) {
+            if (options.max_concurrent_transfers > 0 && transfers >= options.max_concurrent_transfers) {
+                return Reject(call_class, std::max(queue_delay_ms, estimate_ms), "Too many concurrent transfers");
+            }
+            if (options.max_buffered_bytes > 0 && buffered_bytes > 0 && buffered_bytes + bytes > options.max_buffered_bytes) {
+                return Reject(call_class, std::max(queue_delay_ms, estimate_ms), "Too many bytes buffered");
+            }
+        }
+
+        if (options.max_queue_delay_ms > 0 && queue_delay_ms > options.max_queue_delay_ms) {
+            DecayLocked(call_class);
+            return Reject(call_class, queue_delay_ms, "Server overloaded");
+        }
+
+        std::chrono::duration<double, std::milli> remaining = deadline - std::chrono::system_clock::now();
+        if (remaining.count() < queue_delay_ms + estimate_ms) {
+            DecayLocked(call_class);
+            return Reject(call_class, queue_delay_ms, "Deadline would expire before the call completes");
+        }
+
+        in_flight++;
+        if (call_class == TRANSFER) {
+            transfers++;
+            buffered_bytes += bytes;
+        }
+        return Ticket(this, call_class, bytes);
+    }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef DFSLIB_CHANNELPOOL_P2_H
+#define DFSLIB_CHANNELPOOL_P2_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+
+#include "proto-src/dfs-service.grpc.pb.h"
+
+/** Tuning for the channels opened by a ChannelPool **/
+struct ChannelPoolOptions {
+    /** Channels (and therefore TCP connections) opened per target **/
+    int channels_per_target = 4;
+
+    /**
+     * Interval between keepalive pings while calls are active. Servers reject
+     * pings more often than every 5 minutes by default and answer with GOAWAY
+     * too_many_pings, so keep this at 5 minutes or more unless the server's
+     * ping policy is relaxed as well.
+     **/
+    int keepalive_time_ms = 5 * 60 * 1000;
+
+    /** Time to wait for a keepalive ack before the connection is considered dead **/
+    int keepalive_timeout_ms = 10000;
+};
+
+/**
+ * A set of independent gRPC channels to one or more server nodes.
+ *
+ * Every channel gets its own subchannel pool so connections are never shared,
+ * which lets concurrent transfers use separate congestion windows and gRPC I/O
+ * threads. Acquire() hands out the channel with the fewest calls in flight.
+ */
+class ChannelPool {
+
+private:
+    struct Slot {
+        std::string target;
+        std::shared_ptr<grpc::Channel> channel;
+        std::unique_ptr<dfs_service::DFSService::Stub> stub;
+        std::atomic<int> in_flight{0};
+    };
+
+    std::vector<std::unique_ptr<Slot>> slots;
+
+    /** Rotates the scan start so ties do not always land on the first channel **/
+    std::atomic<size_t> cursor{0};
+
+public:
+
+    /** A stub borrowed from the pool; counts as in flight until destroyed **/
+    class Lease {
+    private:
+        dfs_service::DFSService::Stub* stub;
+        std::atomic<int>* in_flight;
+        const std::string* target_name;
+
+    public:
+        Lease(dfs_service::DFSService::Stub* stub, std::atomic<int>* in_flight, const std::string* target_name)
+            : stub(stub), in_flight(in_flight), target_name(target_name) {}
+
+        Lease(Lease&& other) noexcept
+            : stub(other.stub), in_flight(other.in_flight), target_name(other.target_name) {
+            other.in_flight = nullptr;
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease& operator=(Lease&&) = delete;
+
+        ~Lease() {
+            if (in_flight) {
+                in_flight->fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        dfs_service::DFSService::Stub* get() const { return stub; }
+        dfs_service::DFSService::Stub* operator->() const { return stub; }
+        const std::string& target() const { return *target_name; }
+    };
+
+private:
+    Slot* LeastLoaded(const std::string& address) {
+        Slot* best = nullptr;
+        size_t start = cursor.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < slots.size(); ++i) {
+            Slot* slot = slots[(start + i) % slots.size()].get();
+            if (!address.empty() && slot->target != address) {
+                continue;
+            }
+            if (!best || slot->in_flight.load(std::memory_order_relaxed) < best->in_flight.load(std::memory_order_relaxed)) {
+                best = slot;
+            }
+        }
+        return best;
+    }
+
+public:
+    void AddTarget(const std::string& address, const ChannelPoolOptions& options) {
+        for (int i = 0; i < options.channels_per_target; ++i) {
+            grpc::ChannelArguments args;
+            // A distinct argument plus a local subchannel pool forces a separate connection per channel
+            args.SetInt("dfs.channel_index", static_cast<int>(slots.size()));
+            args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+            args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, options.keepalive_time_ms);
+            args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, options.keepalive_timeout_ms);
+
+            std::unique_ptr<Slot> slot(new Slot());
+            slot->target = address;
+            slot->channel = grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+            slot->stub = dfs_service::DFSService::NewStub(slot->channel);
+            slots.push_back(std::move(slot));
+        }
+    }
+
+    bool Empty() const {
+        return slots.empty();
+    }
+
+    /**
+     * Least-loaded channel across all targets, or only those of an already
+     * added target. An address that was never added falls back to all
+     * targets. An empty pool yields a lease with a null stub, so callers
+     * check Empty() first.
+     **/
+    Lease Acquire(const std::string& address = "") {
+        static const std::string no_target;
+        Slot* best = LeastLoaded(address);
+        if (!best && !address.empty()) {
+            best = LeastLoaded("");
+        }
+        if (!best) {
+            return Lease(nullptr, nullptr, &no_target);
+        }
+
+        best->in_flight.fetch_add(1, std::memory_order_relaxed);
+        return Lease(best->stub.get(), &best->in_flight, &best->target);
+    }
+};
+
+#endif
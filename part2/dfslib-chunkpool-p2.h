@@ -0,0 +1,118 @@
+#ifndef DFSLIB_CHUNKPOOL_P2_H
+#define DFSLIB_CHUNKPOOL_P2_H
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+/** Initial size of the chunks streamed by file transfers **/
+const int TRANSFER_CHUNK_SIZE = 64 * 1024;
+
+/** Default upper bound on adaptively sized chunks **/
+const int MAX_TRANSFER_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * Free list of protobuf messages shared by the streaming paths.
+ *
+ * Every message handed out has its chunk buffer reserved up to the largest
+ * configured chunk size, and released messages are cleared, which keeps that
+ * capacity. A transfer that reads into or serializes from a leased message
+ * therefore allocates nothing per chunk, and nothing per call once the pool is
+ * warm. Reserving the exact size matters: letting the buffer grow on demand
+ * would round its capacity up geometrically, past any cap near the chunk
+ * size. Messages whose chunk grew beyond CHUNK_CAPACITY_SLACK times the
+ * reservation, e.g. from a peer sending larger chunks, are freed instead of
+ * kept, bounding the memory parked in the pool.
+ */
+template <typename Message>
+class MessagePool {
+
+private:
+    static const size_t CHUNK_CAPACITY_SLACK = 2;
+
+    size_t max_idle;
+    size_t chunk_capacity;
+    std::mutex pool_m;
+    std::vector<std::unique_ptr<Message>> idle;
+
+    void Release(std::unique_ptr<Message> message) {
+        message->Clear();
+        std::lock_guard<std::mutex> lock(pool_m);
+        if (message->chunk().capacity() > chunk_capacity * CHUNK_CAPACITY_SLACK) {
+            return;
+        }
+        if (idle.size() < max_idle) {
+            idle.push_back(std::move(message));
+        }
+    }
+
+public:
+    /** Message checked out of the pool, returned to it on destruction **/
+    class Lease {
+
+    private:
+        MessagePool* pool;
+        std::unique_ptr<Message> message;
+
+    public:
+        Lease(MessagePool* pool, std::unique_ptr<Message> message)
+            : pool(pool), message(std::move(message)) {}
+
+        Lease(Lease&& other) = default;
+        Lease& operator=(Lease&& other) = delete;
+
+        ~Lease() {
+            if (message) {
+                pool->Release(std::move(message));
+            }
+        }
+
+        Message* get() const {
+            return message.get();
+        }
+
+        Message* operator->() const {
+            return message.get();
+        }
+
+        Message& operator*() const {
+            return *message;
+        }
+    };
+
+    explicit MessagePool(size_t max_idle = 64, size_t chunk_capacity = MAX_TRANSFER_CHUNK_SIZE)
+        : max_idle(max_idle), chunk_capacity(chunk_capacity) {
+        idle.reserve(max_idle);
+    }
+
+    /** Raises the reservation to fit chunks of `max_chunk` bytes; pools are shared, so it never shrinks **/
+    void ReserveChunks(size_t max_chunk) {
+        std::lock_guard<std::mutex> lock(pool_m);
+        chunk_capacity = std::max(chunk_capacity, max_chunk);
+    }
+
+    Lease Acquire() {
+        std::unique_ptr<Message> message;
+        size_t capacity;
+        {
+            std::lock_guard<std::mutex> lock(pool_m);
+            if (!idle.empty()) {
+                message = std::move(idle.back());
+                idle.pop_back();
+            }
+            capacity = chunk_capacity;
+        }
+        if (!message) {
+            message.reset(new Message());
+        }
+        // Only fresh messages, or ones from before the reservation was raised, allocate here
+        if (message->chunk().capacity() < capacity) {
+            message->mutable_chunk()->reserve(capacity);
+        }
+        return Lease(this, std::move(message));
+    }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef DFSLIB_CHUNKSIZER_P2_H
+#define DFSLIB_CHUNKSIZER_P2_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "dfslib-chunkpool-p2.h"
+
+/** Bounds must stay below gRPC's 4 MiB default maximum message size **/
+struct ChunkSizerOptions {
+    size_t min_chunk = 16 * 1024;
+    size_t max_chunk = MAX_TRANSFER_CHUNK_SIZE;
+    size_t initial_chunk = TRANSFER_CHUNK_SIZE;
+
+    /** Time one chunk should take at the measured throughput, amortizing per-message overhead **/
+    int64_t target_chunk_us = 4000;
+
+    /** Shortest blocking Write treated as flow-control pushback; raised to the RTT when known **/
+    int64_t min_stall_us = 5000;
+
+    /** Weight of the newest sample in the throughput average **/
+    double alpha = 0.25;
+};
+
+/**
+ * Picks the size of the next chunk of one outgoing stream.
+ *
+ * The target is the measured throughput times `target_chunk_us`, so fast
+ * links get large chunks and slow links small ones. The size moves toward the
+ * target by at most a factor of two per chunk. A Write that blocks longer than
+ * the stall threshold means the gRPC flow-control window is exhausted. In that
+ * case the size is halved, and the halved size becomes a ceiling that is only
+ * probed upward slowly afterwards.
+ */
+class ChunkSizer {
+
+private:
+    ChunkSizerOptions options;
+    size_t size;
+    size_t ceiling;
+    int64_t rtt_us = 0;
+
+    /** Bytes per microsecond, 0 until the first sample **/
+    double throughput = 0;
+    std::chrono::steady_clock::time_point last_record;
+
+    size_t Clamp(double value) const {
+        return static_cast<size_t>(std::max<double>(options.min_chunk, std::min<double>(options.max_chunk, value)));
+    }
+
+public:
+    explicit ChunkSizer(const ChunkSizerOptions& options)
+        : options(options), size(Clamp(options.initial_chunk)), ceiling(options.max_chunk) {}
+
+    size_t Size() const {
+        return size;
+    }
+
+    /** Round-trip estimate for the peer; Writes blocking about this long are waiting on the window **/
+    void ObserveRtt(std::chrono::microseconds rtt) {
+        rtt_us = rtt.count();
+    }
+
+    /** Feeds back one sent chunk and how long its Write blocked **/
+    void Record(size_t bytes, std::chrono::steady_clock::duration write_time) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int64_t write_us = std::chrono::duration_cast<std::chrono::microseconds>(write_time).count();
+
+        // Throughput spans everything between chunks (disk, throttling, Write), not just the Write
+        int64_t interval_us = last_record == std::chrono::steady_clock::time_point()
+            ? write_us
+            : std::chrono::duration_cast<std::chrono::microseconds>(now - last_record).count();
+        last_record = now;
+        if (interval_us > 0) {
+            double sample = static_cast<double>(bytes) / interval_us;
+            throughput = throughput == 0 ? sample : (1 - options.alpha) * throughput + options.alpha * sample;
+        }
+
+        if (write_us > std::max(options.min_stall_us, rtt_us)) {
+            size = Clamp(size / 2);
+            ceiling = size;
+            return;
+        }
+
+        ceiling = Clamp(ceiling + ceiling / 32);
+        if (throughput > 0) {
+            double target = std::min<double>(throughput * options.target_chunk_us, ceiling);
+            size = Clamp(std::max<double>(size / 2, std::min<double>(size * 2, target)));
+        }
+    }
+};
+
+#endif
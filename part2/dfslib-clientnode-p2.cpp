@@ -1,3 +1,5 @@
+#include <map>
+#include <set>
 #include <regex>
 #include <mutex>
 #include <vector>
@@ -5,6 +7,9 @@
 #include <thread>
 #include <cstdio>
 #include <chrono>
+#include <atomic>
+#include <random>
+#include <functional>
 #include <errno.h>
 #include <csignal>
 #include <iostream>
@@ -14,10 +19,20 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 #include <utime.h>
 
+#include "dfslib-channelpool-p2.h"
+#include "dfslib-manifest-p2.h"
+#include "dfslib-staged-p2.h"
+#include "dfslib-chunkpool-p2.h"
+#include "dfslib-chunksizer-p2.h"
+#include "dfslib-prefetch-p2.h"
+#include "dfslib-accesswatch-p2.h"
+#include "dfslib-log-p2.h"
+
 using grpc::Status;
 using grpc::Channel;
 using grpc::StatusCode;
@@ -25,22 +40,205 @@ using grpc::ClientWriter;
 using grpc::ClientReader;
 using grpc::ClientContext;
 
+using dfs_service::DFSService;
+
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
+/** Bounds of the exponential backoff applied when the server sheds load **/
+const long BACKOFF_BASE_MS = 20;
+const long BACKOFF_MAX_MS = 2000;
+
+thread_local std::mt19937 backoff_rng(std::random_device{}());
+
+/** Chunk messages recycled across transfers so streaming does not allocate per chunk **/
+static MessagePool<FileContext> file_chunks;
+static MessagePool<RangeChunk> range_chunks;
+
+/** `<mount><suffix>`, a sibling of the mount that the sync watcher never sees **/
+static string mount_sibling(const string& mount_path, const string& suffix) {
+    string mount_dir = mount_path;
+    while (mount_dir.size() > 1 && mount_dir.back() == '/') {
+        mount_dir.pop_back();
+    }
+    return mount_dir + suffix;
+}
+
+/**
+ * Directory downloads are received in before being renamed into the mount.
+ * Staging inside the mount would let the base sync watcher see, and upload,
+ * half-written temporary files. Falls back to the mount (empty result) when
+ * the sibling cannot be created or is on another file system, where the
+ * rename into the mount would fail.
+ */
+static string download_staging_dir(const string& mount_path) {
+    string staging_dir = mount_sibling(mount_path, ".staging");
+    struct stat staging_stats, mount_stats;
+    if ((mkdir(staging_dir.c_str(), 0755) != 0 && errno != EEXIST) ||
+        stat(staging_dir.c_str(), &staging_stats) != 0 || stat(mount_path.c_str(), &mount_stats) != 0 ||
+        staging_stats.st_dev != mount_stats.st_dev) {
+        return "";
+    }
+    return staging_dir;
+}
+
 DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode() {}
-DFSClientNodeP2::~DFSClientNodeP2() {}
+DFSClientNodeP2::~DFSClientNodeP2() {
+    // Stop the prefetch threads before the state their fetches use goes away
+    access_watcher.reset();
+    prefetcher.reset();
+}
 
-grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename) {
+void DFSClientNodeP2::ConfigureChannelPool(const std::string &server_address, const ChannelPoolOptions &options) {
+    dfs_log(LL_SYSINFO) << "Opening " << options.channels_per_target << " channels to " << server_address;
+    pool_options = options;
+    write_pool.AddTarget(server_address, options);
+}
+
+void DFSClientNodeP2::ConfigureChunkSizing(const ChunkSizerOptions &options) {
+    chunk_options = options;
+    file_chunks.ReserveChunks(options.max_chunk);
+    range_chunks.ReserveChunks(options.max_chunk);
+}
+
+void DFSClientNodeP2::EnablePrefetch(const PrefetchOptions &options) {
+    dfs_log(LL_SYSINFO) << "Prefetching related files at up to " << options.bytes_per_sec << " bytes/s";
+    access_watcher.reset();
+    prefetcher.reset(new Prefetcher(options,
+        [this](const string& filename) {
+            // A file the sync loop is already fetching is left to it
+            InFlightFetches::Scope fetch(fetches, filename, false);
+            if (!fetch.Owned()) {
+                return true;
+            }
+            StatusCode result = this->FetchFile(filename);
+            return result == StatusCode::OK || result == StatusCode::ALREADY_EXISTS;
+        },
+        [this](const string& filename) {
+            struct stat file_stats;
+            return stat(WrapPath(filename).c_str(), &file_stats) == 0 ? static_cast<int64_t>(file_stats.st_mtime) : 0;
+        }));
+
+    access_watcher.reset(new AccessWatcher(mount_path, [this](const string& filename, uint32_t mask) {
+        this->ObserveAccess(filename, mask);
+    }));
+    if (!access_watcher->Watching()) {
+        dfs_log(LL_ERROR) << "Failed to watch " << mount_path << " for accesses, prefetching only on server changes";
+    }
+}
+
+// Called by the access watcher for every open or completed write in the mount
+void DFSClientNodeP2::ObserveAccess(const std::string &filename, uint32_t mask) {
+    if (!prefetcher || (mask & IN_ISDIR) || is_staged_file(filename)) {
+        return;
+    }
+    if (mask & (IN_OPEN | IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        prefetcher->Observe(filename);
+    }
+}
+
+void DFSClientNodeP2::AddReplica(const std::string &server_address) {
+    dfs_log(LL_SYSINFO) << "Reading from replica " << server_address;
+    read_pool.AddTarget(server_address, pool_options);
+    // Replicas are added in chain order, so the last one is the tail
+    tail_address = server_address;
+}
+
+ChannelPool::Lease DFSClientNodeP2::WriteStub() {
+    if (write_pool.Empty()) {
+        return ChannelPool::Lease(service_stub.get(), nullptr, &tail_address);
+    }
+    return write_pool.Acquire();
+}
+
+ChannelPool::Lease DFSClientNodeP2::ReadStub() {
+    if (read_pool.Empty()) {
+        return WriteStub();
+    }
+    return read_pool.Acquire();
+}
+
+ChannelPool::Lease DFSClientNodeP2::TailStub() {
+    if (read_pool.Empty()) {
+        return WriteStub();
+    }
+    return read_pool.Acquire(tail_address);
+}
+
+bool DFSClientNodeP2::IsTail(const ChannelPool::Lease &stub) {
+    return read_pool.Empty() || stub.target() == tail_address;
+}
+
+StatusCode DFSClientNodeP2::WithBackoff(const std::function<StatusCode(ClientContext*)> &attempt) {
+    // Retries share the caller's deadline rather than extending it
+    system_clock::time_point deadline = system_clock::now() + milliseconds(deadline_timeout);
+
+    for (int retry = 0; ; ++retry) {
+        ClientContext context;
+        context.set_deadline(deadline);
+        StatusCode result = attempt(&context);
+        if (result != StatusCode::RESOURCE_EXHAUSTED) {
+            return result;
+        }
+
+        // Only shed calls carry a hint; other RESOURCE_EXHAUSTED results (e.g. a held lock) are final
+        const multimap<grpc::string_ref, grpc::string_ref>& trailers = context.GetServerTrailingMetadata();
+        multimap<grpc::string_ref, grpc::string_ref>::const_iterator hint = trailers.find("retry-after-ms");
+        if (hint == trailers.end()) {
+            return result;
+        }
 
-    ClientContext context;
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
+        long retry_after = atol(string(hint->second.data(), hint->second.size()).c_str());
+        long ceiling = min(BACKOFF_MAX_MS, BACKOFF_BASE_MS << min(retry, 16));
+        uniform_int_distribution<long> jitter(0, ceiling);
+        milliseconds delay(max(retry_after, jitter(backoff_rng)));
+        if (system_clock::now() + delay >= deadline) {
+            shed_calls.fetch_add(1, std::memory_order_relaxed);
+            return result;
+        }
+
+        dfs_log(LL_DEBUG2) << "Server overloaded, retrying in " << delay.count() << "ms";
+        this_thread::sleep_for(delay);
+    }
+}
+
+Status DFSClientNodeP2::CallReplica(const std::function<Status(DFSService::Stub*, ClientContext*)> &call) {
+    Status result;
+    {
+        ChannelPool::Lease stub = ReadStub();
+        this->WithBackoff([&](ClientContext* context) {
+            result = call(stub.get(), context);
+            return result.error_code();
+        });
+        if (result.error_code() != StatusCode::UNAVAILABLE || IsTail(stub)) {
+            return result;
+        }
+    }
+
+    dfs_log(LL_DEBUG2) << "Replica not up to date, retrying on tail";
+    ChannelPool::Lease tail = TailStub();
+    this->WithBackoff([&](ClientContext* context) {
+        result = call(tail.get(), context);
+        return result.error_code();
+    });
+    return result;
+}
+
+grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename) {
 
     Blank response;
     FileContext request;
     request.mutable_metadata()->set_name(filename);
     request.mutable_metadata()->set_client_id(client_id);
 
-    Status lock_result = service_stub->GetWriteLock(&context, request, &response);
+    Status lock_result;
+    this->WithBackoff([&](ClientContext* context) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        lock_result = WriteStub()->GetWriteLock(context, request, &response);
+        if (lock_result.ok()) {
+            this->ObserveRtt(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start));
+        }
+        return lock_result.error_code();
+    });
     if (!lock_result.ok()) {
         dfs_log(LL_ERROR) << lock_result.error_message();
         return lock_result.error_code();
@@ -50,6 +248,17 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
     return StatusCode::OK;
 }
 
+uint64_t DFSClientNodeP2::ShedCalls() const {
+    return shed_calls.load(std::memory_order_relaxed);
+}
+
+// The lock round trip includes server work, so the smallest one seen is the best RTT estimate
+void DFSClientNodeP2::ObserveRtt(std::chrono::microseconds rtt) {
+    int64_t seen = min_rtt_us.load(std::memory_order_relaxed);
+    while ((seen == 0 || rtt.count() < seen) &&
+           !min_rtt_us.compare_exchange_weak(seen, rtt.count(), std::memory_order_relaxed)) {}
+}
+
 grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
 
     dfs_log(LL_DEBUG2) << "Entering Store";
@@ -61,16 +270,36 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
         return StatusCode::NOT_FOUND;
     }
 
+    Prefetcher::ForegroundScope foreground(prefetcher.get());
     StatusCode lock_result = this->RequestWriteAccess(filename);
     if (lock_result != StatusCode::OK) {
         return lock_result;
     }
 
+    StatusCode upload_result = this->WithBackoff([&](ClientContext* context) {
+        return this->Upload(context, filename, client_stats);
+    });
+
+    // However the upload failed (shed, deadline, server error), the lock must not stay held until it expires
+    if (upload_result != StatusCode::OK) {
+        this->CedeWriteAccess(filename);
+    } else {
+        this->NoteLocalChange(filename);
+    }
+    return upload_result;
+}
+
+grpc::StatusCode DFSClientNodeP2::Upload(ClientContext* context, const std::string &filename, const FileContext &client_stats) {
+
+    const string& full_path = WrapPath(filename);
     FileContext response;
-    unique_ptr<ClientWriter<FileContext>> writer = service_stub->UploadFile(&context, &response);
+    ChannelPool::Lease stub = WriteStub();
+    unique_ptr<ClientWriter<FileContext>> writer = stub->UploadFile(context, &response);
         
     Context client;
     client.mutable_metadata()->set_name(filename);
+    client.mutable_metadata()->set_client_id(client_id);
+    client.mutable_metadata()->set_size(client_stats.metadata().size());
     client.mutable_metadata()->set_last_modified(client_stats.metadata().last_modified());
 
     dfs_log(LL_SYSINFO) << "Uploading file '" << full_path << "' with mtime " << client_stats.metadata().last_modified();
@@ -80,19 +309,44 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
         return StatusCode::CANCELLED;
     }
 
+    if (prefetcher) {
+        prefetcher->NoteOwnAccess(filename);
+    }
     ifstream ifs(full_path, ios::binary);
     if (!ifs.is_open()) {
-        this->CedeWriteAccess(filename);
         dfs_log(LL_ERROR) << "Failed to open file";
         return StatusCode::CANCELLED;
     }
 
-    // Redacted storing file chunks
+    // File data is read straight into the leased message's chunk buffer
+    MessagePool<FileContext>::Lease content = file_chunks.Acquire();
+    string& chunk = *content->mutable_chunk();
+    ChunkSizer sizer(chunk_options);
+    if (min_rtt_us.load(std::memory_order_relaxed) > 0) {
+        sizer.ObserveRtt(chrono::microseconds(min_rtt_us.load(std::memory_order_relaxed)));
+    }
+    while (true) {
+        chunk.resize(sizer.Size());
+        ifs.read(&chunk[0], chunk.size());
+        if (ifs.gcount() <= 0) {
+            break;
+        }
+        chunk.resize(ifs.gcount());
+        chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+        if (!writer->Write(*content)) {
+            break;
+        }
+        sizer.Record(chunk.size(), chrono::steady_clock::now() - write_start);
+    }
+    dfs_log(LL_DEBUG3) << "Upload of '" << filename << "' finished with " << sizer.Size() << " byte chunks";
+    ifs.close();
+
+    writer->WritesDone();
+    Status server_result = writer->Finish();
 
     if (!server_result.ok()) {
         dfs_log(LL_ERROR) << "Upload failed";
         if (server_result.error_code() == StatusCode::INTERNAL) {
-            this->CedeWriteAccess(filename);
             return StatusCode::CANCELLED;
         }
     }
@@ -102,38 +356,139 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
 grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
 
     dfs_log(LL_DEBUG2) << "Entering Fetch";
-    ClientContext context;
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
+    Prefetcher::ForegroundScope foreground(prefetcher.get());
+    // Waits out a prefetch of the same file; the CRC check then skips the download if it is current
+    InFlightFetches::Scope fetch(fetches, filename);
+    return this->FetchFile(filename);
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchFile(const std::string &filename) {
+
+    StatusCode result;
+    {
+        ChannelPool::Lease stub = ReadStub();
+        result = this->WithBackoff([&](ClientContext* context) {
+            return this->FetchFrom(stub.get(), context, filename);
+        });
+        if (result != StatusCode::UNAVAILABLE || IsTail(stub)) {
+            return result;
+        }
+    }
+
+    dfs_log(LL_DEBUG2) << "Replica not up to date on '" << filename << "', fetching from tail";
+    ChannelPool::Lease tail = TailStub();
+    return this->WithBackoff([&](ClientContext* context) {
+        return this->FetchFrom(tail.get(), context, filename);
+    });
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchFrom(DFSService::Stub* stub, ClientContext* context, const std::string &filename) {
 
     FileContext request;
     request.mutable_metadata()->set_name(filename);
+    request.mutable_metadata()->set_client_id(client_id);
 
     const string& full_path = WrapPath(filename);
+    if (prefetcher) {
+        prefetcher->NoteOwnAccess(filename);
+    }
     uint32_t client_crc = dfs_file_checksum(full_path, &this->crc_table);
     request.mutable_metadata()->set_crc(client_crc);
 
-    unique_ptr<ClientReader<FileContext>> reader = service_stub->DownloadFile(&context, request);
-    
-    FileContext content;
-    
-    // Redacted receiving files
+    unique_ptr<ClientReader<FileContext>> reader = stub->DownloadFile(context, request);
+
+    // The server sends the file's metadata first and then its data. The data is received under a
+    // temporary name and replaces the local copy only once complete, so a failed or cancelled
+    // download leaves the local copy alone.
+    MessagePool<FileContext>::Lease content = file_chunks.Acquire();
+    unique_ptr<StagedFile> staged;
+    int64_t server_mtime = 0;
+    if (reader->Read(content.get())) {
+        server_mtime = content->metadata().last_modified();
+        staged.reset(new StagedFile(full_path, download_staging_dir(mount_path)));
+        if (staged->IsOpen()) {
+            while (reader->Read(content.get())) {
+                staged->stream.write(content->chunk().data(), content->chunk().size());
+            }
+        } else {
+            dfs_log(LL_ERROR) << "Failed to open file '" << full_path << "' for writing";
+            context->TryCancel();
+        }
+    }
+
+    Status server_result = reader->Finish();
+    if (server_result.ok() && prefetcher) {
+        prefetcher->NoteOwnAccess(filename);
+    }
+    if (server_result.ok() && (!staged || !staged->Commit(server_mtime))) {
+        dfs_log(LL_ERROR) << "Failed to store file '" << full_path << "'";
+        server_result = Status(StatusCode::INTERNAL, "Failed to store file");
+    }
 
     if (!server_result.ok()) {
         dfs_log(LL_ERROR) << "Download failed";
         if (server_result.error_code() == StatusCode::INTERNAL) {
             return StatusCode::CANCELLED;
         }
+    } else {
+        this->NoteLocalChange(filename);
     }
     return server_result.error_code();
 
 }
 
+grpc::StatusCode DFSClientNodeP2::ReadRange(const std::string &filename, int64_t offset, int64_t length, std::string* buffer) {
+
+    std::vector<std::pair<int64_t, int64_t>> ranges = {{offset, length}};
+    std::vector<std::string> buffers;
+    StatusCode result = this->ReadRanges(filename, ranges, &buffers);
+    if (result == StatusCode::OK) {
+        buffer->swap(buffers[0]);
+    }
+    return result;
+}
+
+grpc::StatusCode DFSClientNodeP2::ReadRanges(const std::string &filename,
+                                             const std::vector<std::pair<int64_t, int64_t>> &ranges,
+                                             std::vector<std::string>* buffers) {
+
+    dfs_log(LL_DEBUG2) << "Entering ReadRanges";
+    RangeRequest request;
+    request.set_name(filename);
+    request.set_client_id(client_id);
+    for (const pair<int64_t, int64_t>& range : ranges) {
+        ByteRange* byte_range = request.add_ranges();
+        byte_range->set_offset(range.first);
+        byte_range->set_length(range.second);
+    }
+
+    Status server_result = this->CallReplica([&](DFSService::Stub* stub, ClientContext* context) {
+        buffers->assign(ranges.size(), string());
+        unique_ptr<ClientReader<RangeChunk>> reader = stub->ReadRange(context, request);
+
+        MessagePool<RangeChunk>::Lease content = range_chunks.Acquire();
+        while (reader->Read(content.get())) {
+            if (content->range_index() < 0 || content->range_index() >= static_cast<int>(ranges.size())) {
+                context->TryCancel();
+                break;
+            }
+            (*buffers)[content->range_index()].append(content->chunk());
+        }
+        return reader->Finish();
+    });
+
+    if (!server_result.ok()) {
+        dfs_log(LL_ERROR) << "ReadRange failed: " << server_result.error_message();
+        if (server_result.error_code() == StatusCode::INTERNAL) {
+            return StatusCode::CANCELLED;
+        }
+    }
+    return server_result.error_code();
+}
+
 grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
 
     dfs_log(LL_DEBUG2) << "Entering Delete";
-    ClientContext context;
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
-    
     FileContext request;
     request.mutable_metadata()->set_name(filename);
     Blank response;
@@ -143,13 +498,20 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
         return lock_result;
     }
 
-    Status server_result = service_stub->RemoveFile(&context, request, &response);
+    Status server_result;
+    this->WithBackoff([&](ClientContext* context) {
+        server_result = WriteStub()->RemoveFile(context, request, &response);
+        return server_result.error_code();
+    });
+    // As in Store, a failed removal must not keep the lock held until it expires
     if (!server_result.ok()) {
         dfs_log(LL_ERROR) << "RemoveFile failed";
+        this->CedeWriteAccess(filename);
         if (server_result.error_code() == StatusCode::INTERNAL) {
-            this->CedeWriteAccess(filename);
             return StatusCode::CANCELLED;
         }
+    } else {
+        this->NoteLocalChange(filename);
     }
     return server_result.error_code();
 }
@@ -157,13 +519,15 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
 grpc::StatusCode DFSClientNodeP2::List(std::map<std::string,int>* file_map, bool display) {
 
     dfs_log(LL_DEBUG2) << "Entering List";
-    ClientContext context;
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
-
     Blank request;
     FileCatalog response;
 
-    Status server_result = service_stub->ListFiles(&context, request, &response);
+    Status server_result = this->CallReplica([&](DFSService::Stub* stub, ClientContext* context) {
+        response.Clear();
+        // ListFiles takes no request fields, so the server keys its rate limit on this instead
+        context->AddMetadata("dfs-client-id", client_id);
+        return stub->ListFiles(context, request, &response);
+    });
     if (!server_result.ok()) {
         dfs_log(LL_ERROR) << "Listing files failed";
         if (server_result.error_code() == StatusCode::INTERNAL) {
@@ -181,13 +545,13 @@ grpc::StatusCode DFSClientNodeP2::List(std::map<std::string,int>* file_map, bool
 
 grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void* file_status) {
 
-    ClientContext context;
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
-
     FileContext request, response;
     request.mutable_metadata()->set_name(filename);
+    request.mutable_metadata()->set_client_id(client_id);
 
-    Status server_result = service_stub->GetFileStatus(&context, request, &response);
+    Status server_result = this->CallReplica([&](DFSService::Stub* stub, ClientContext* context) {
+        return stub->GetFileStatus(context, request, &response);
+    });
     if (!server_result.ok()) {
         dfs_log(LL_ERROR) << "GetFileStatus failed";
         if (server_result.error_code() == StatusCode::INTERNAL) {
@@ -203,6 +567,10 @@ void DFSClientNodeP2::HandleCallbackList() {
     void* tag;
     bool ok = false;
 
+    // Catch up on changes made on either side while the client was offline
+    this->LoadManifest();
+    this->Reconcile();
+
     while (completion_queue.Next(&tag, &ok)) {
         {
 
@@ -222,30 +590,214 @@ void DFSClientNodeP2::HandleCallbackList() {
 
                 // Redacted file deletion broadcast
 
-                for (const FileContext& server_file : call_data->reply.files()) {
-                    FileContext local_file;
-                    StatusCode server_result = StatusCode::OK;
-                    const string& local_path = WrapPath(server_file.metadata().name());
-
-                    dfs_log(LL_DEBUG2) << "Checking on file '" << server_file.metadata().name() << "'";
-                    get_file_status(local_path, &local_file);
-
-                    // Redacted file synchronization logic
-                    if (client_mtime != server_mtime) {
-                        // Check if file does not exist locally
-                        if (client_mtime == 0) {}
-                        // Check if local file is up-to-date
-                        else if (client_mtime < server_mtime) {}
-                        // Check if file on server needs to be updated
-                        else if (client_mtime > server_mtime) {}
+                if (prefetcher) {
+                    for (const FileContext& server_file : call_data->reply.files()) {
+                        prefetcher->NoteRemote(server_file.metadata().name(), server_file.metadata().last_modified(),
+                                               server_file.metadata().size());
                     }
                 }
+
+                // Only files in buckets whose hashes differ from the server's are compared and synced
+                StatusCode sync_result = this->Reconcile();
+                if (sync_result != StatusCode::OK) {
+                    dfs_log(LL_ERROR) << "Sync with server failed, retrying on the next callback";
+                }
             }
         }
     }
 }
 
 
+void DFSClientNodeP2::LoadManifest() {
+    // The manifest lives next to the mount so it is never synced itself
+    manifest_path = mount_sibling(mount_path, ".manifest");
+
+    manifest.Load(manifest_path);
+    vector<ManifestEntry> removed = manifest.Refresh(mount_path, [this](const string& file_path) {
+        return dfs_file_checksum(file_path, &this->crc_table);
+    });
+
+    // Anything recorded last session but gone now was deleted while the client was offline
+    for (const ManifestEntry& entry : removed) {
+        dfs_log(LL_DEBUG2) << "File '" << entry.name << "' was deleted while offline";
+        offline_deletions[entry.name] = entry;
+    }
+    // Not saved here: the file on disk keeps describing the last fully synced state until Reconcile succeeds
+}
+
+void DFSClientNodeP2::NoteLocalChange(const std::string &filename) {
+    const string& full_path = WrapPath(filename);
+    struct stat file_stats;
+    if (stat(full_path.c_str(), &file_stats) != 0) {
+        manifest.Remove(filename);
+        return;
+    }
+
+    ManifestEntry entry;
+    entry.name = filename;
+    entry.size = file_stats.st_size;
+    entry.mtime = file_stats.st_mtime;
+    if (prefetcher) {
+        prefetcher->NoteOwnAccess(filename);
+    }
+    entry.crc = dfs_file_checksum(full_path, &this->crc_table);
+    manifest.Upsert(entry);
+}
+
+grpc::StatusCode DFSClientNodeP2::Reconcile() {
+
+    dfs_log(LL_DEBUG2) << "Entering Reconcile";
+    ManifestQuery query;
+    ManifestNode* root = query.add_nodes();
+    root->set_level(0);
+    root->set_index(0);
+
+    // Walk down one level per round trip, keeping only the subtrees whose hashes differ
+    map<string, MetaData> server_files;
+    set<int> buckets;
+    for (int level = 0; query.nodes_size() > 0; ++level) {
+        ManifestReply reply;
+        Status server_result = this->CallReplica([&](DFSService::Stub* stub, ClientContext* context) {
+            reply.Clear();
+            return stub->GetManifest(context, query, &reply);
+        });
+        if (!server_result.ok()) {
+            dfs_log(LL_ERROR) << "GetManifest failed: " << server_result.error_message();
+            return server_result.error_code();
+        }
+
+        if (level == 0 && reply.root() == manifest.Root()) {
+            dfs_log(LL_DEBUG2) << "Manifest matches server, nothing to reconcile";
+            offline_deletions.clear();
+            if (manifest.Unsaved()) {
+                manifest.Save(manifest_path);
+            }
+            return StatusCode::OK;
+        }
+
+        for (const MetaData& file : reply.files()) {
+            server_files[file.name()] = file;
+        }
+
+        ManifestQuery next;
+        for (const ManifestNode& node : reply.nodes()) {
+            if (node.hash() == manifest.NodeHash(node.level(), node.index())) {
+                continue;
+            }
+            if (node.level() == Manifest::DEPTH) {
+                buckets.insert(node.index());
+            }
+            *next.add_nodes() = node;
+        }
+        query = next;
+    }
+
+    map<string, ManifestEntry> local_files;
+    for (int bucket : buckets) {
+        for (const ManifestEntry& entry : manifest.BucketEntries(bucket)) {
+            local_files[entry.name] = entry;
+        }
+    }
+
+    // The manifest may lag behind writes not yet reported, so candidates are compared by what is on disk now
+    set<string> candidates;
+    for (const pair<const string, ManifestEntry>& local_file : local_files) {
+        candidates.insert(local_file.first);
+    }
+    for (const pair<const string, MetaData>& server_file : server_files) {
+        candidates.insert(server_file.first);
+    }
+    for (const string& name : candidates) {
+        map<string, ManifestEntry>::iterator local = local_files.find(name);
+        struct stat file_stats;
+        if (stat(WrapPath(name).c_str(), &file_stats) != 0) {
+            if (local != local_files.end()) {
+                // Deleted without the server being told; handled like a deletion made offline
+                offline_deletions[name] = local->second;
+                manifest.Remove(name);
+                local_files.erase(local);
+            }
+            continue;
+        }
+        if (local != local_files.end() && local->second.size == file_stats.st_size && local->second.mtime == file_stats.st_mtime) {
+            continue;
+        }
+
+        ManifestEntry entry;
+        entry.name = name;
+        entry.size = file_stats.st_size;
+        entry.mtime = file_stats.st_mtime;
+        entry.crc = dfs_file_checksum(WrapPath(name), &this->crc_table);
+        manifest.Upsert(entry);
+        local_files[name] = entry;
+    }
+
+    dfs_log(LL_DEBUG2) << "Reconciling " << buckets.size() << " differing buckets";
+    StatusCode result = StatusCode::OK;
+    for (const pair<const string, MetaData>& server_file : server_files) {
+        const string& name = server_file.first;
+        const MetaData& server_stats = server_file.second;
+        map<string, ManifestEntry>::const_iterator local = local_files.find(name);
+        map<string, ManifestEntry>::const_iterator deleted = offline_deletions.find(name);
+        StatusCode file_result = StatusCode::OK;
+
+        if (local == local_files.end()) {
+            // Deleted here while offline and unchanged on the server since: propagate the deletion
+            if (deleted != offline_deletions.end() && server_stats.last_modified() <= deleted->second.mtime) {
+                file_result = this->Delete(name);
+            } else {
+                file_result = this->Fetch(name);
+            }
+        } else if (server_stats.last_modified() > local->second.mtime) {
+            file_result = this->Fetch(name);
+        } else if (server_stats.last_modified() < local->second.mtime) {
+            file_result = this->Store(name);
+        } else if (server_stats.crc() != local->second.crc) {
+            file_result = this->Fetch(name);
+        }
+
+        if (file_result != StatusCode::OK && file_result != StatusCode::ALREADY_EXISTS) {
+            result = file_result;
+        }
+    }
+
+    // The saved manifest is the last state both sides agreed on. A file missing on the server that it
+    // records unchanged was deleted there; any other file missing on the server is new here.
+    Manifest synced;
+    synced.Load(manifest_path);
+    for (const pair<const string, ManifestEntry>& local_file : local_files) {
+        const string& name = local_file.first;
+        if (server_files.count(name) != 0) {
+            continue;
+        }
+
+        ManifestEntry previous;
+        StatusCode file_result = StatusCode::OK;
+        if (synced.Get(name, &previous) && previous.mtime == local_file.second.mtime && previous.crc == local_file.second.crc) {
+            dfs_log(LL_DEBUG2) << "File '" << name << "' was deleted on the server";
+            if (unlink(WrapPath(name).c_str()) != 0 && errno != ENOENT) {
+                dfs_log(LL_ERROR) << "Failed to remove '" << name << "'";
+                file_result = StatusCode::INTERNAL;
+            } else {
+                manifest.Remove(name);
+            }
+        } else {
+            file_result = this->Store(name);
+        }
+        if (file_result != StatusCode::OK && file_result != StatusCode::ALREADY_EXISTS) {
+            result = file_result;
+        }
+    }
+
+    if (result == StatusCode::OK) {
+        offline_deletions.clear();
+        if (manifest.Unsaved()) {
+            manifest.Save(manifest_path);
+        }
+    }
+    return result;
+}
+
 grpc::StatusCode DFSClientNodeP2::CedeWriteAccess(const std::string &filename) {
     Blank response;
     FileContext request;
@@ -0,0 +1,118 @@
+#ifndef DFSLIB_HISTOGRAM_P2_H
+#define DFSLIB_HISTOGRAM_P2_H
+
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * HDR-style latency histogram with ~3% relative precision.
+ *
+ * Values below 64 get exact buckets; above that every power of two is split
+ * into 32 linear sub-buckets. Recording is a single relaxed atomic increment,
+ * so one histogram can be shared by many threads. Values are clamped to 2^40
+ * (about 12 days in microseconds).
+ */
+class LatencyHistogram {
+
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_VALUE_BITS = 40;
+    static const int BUCKETS = 2 * SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS - 1) * SUB_BUCKETS;
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+public:
+    LatencyHistogram() {
+        Reset();
+    }
+
+    static int BucketOf(uint64_t value) {
+        value = std::min<uint64_t>(value, (1ULL << MAX_VALUE_BITS) - 1);
+        if (value < 2 * SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BUCKET_BITS;
+        return 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + static_cast<int>((value >> shift) - SUB_BUCKETS);
+    }
+
+    /** Highest value that falls into a bucket **/
+    static uint64_t BucketValue(int bucket) {
+        if (bucket < 2 * SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = (bucket - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+        uint64_t top = (bucket - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+        return ((top + 1) << shift) - 1;
+    }
+
+    void Record(uint64_t value) {
+        counts[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t seen = max.load(std::memory_order_relaxed);
+        while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    }
+
+    void Merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i].fetch_add(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        total.fetch_add(other.Count(), std::memory_order_relaxed);
+        sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t other_max = other.Max();
+        uint64_t seen = max.load(std::memory_order_relaxed);
+        while (other_max > seen && !max.compare_exchange_weak(seen, other_max, std::memory_order_relaxed)) {}
+    }
+
+    void Reset() {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t Count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Max() const {
+        return max.load(std::memory_order_relaxed);
+    }
+
+    uint64_t BucketCount(int bucket) const {
+        return counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    double Mean() const {
+        uint64_t count = Count();
+        return count ? static_cast<double>(sum.load(std::memory_order_relaxed)) / count : 0;
+    }
+
+    /** Value at or below which `percentile` (0-100) of the recorded values fall **/
+    uint64_t Percentile(double percentile) const {
+        uint64_t count = Count();
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(percentile / 100.0 * count + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(BucketValue(i), Max());
+            }
+        }
+        return Max();
+    }
+};
+
+#endif
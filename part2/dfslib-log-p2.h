@@ -0,0 +1,154 @@
+#ifndef DFSLIB_LOG_P2_H
+#define DFSLIB_LOG_P2_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+
+/**
+ * Asynchronous logging backend behind dfs_log.
+ *
+ * A record is filtered twice before anything is formatted: against
+ * DFS_LOG_COMPILE_LEVEL, which is a constant so the compiler drops disabled
+ * call sites entirely, and against the runtime DFS_LOG_LEVEL. Enabled records
+ * are formatted into a fixed stack buffer and pushed onto a lock-free ring
+ * owned by the calling thread; a background thread drains all rings to
+ * stderr. A full ring drops the record and counts it rather than blocking.
+ */
+
+/** Most verbose level compiled in; build with e.g. -DDFS_LOG_COMPILE_LEVEL=LL_SYSINFO **/
+#ifndef DFS_LOG_COMPILE_LEVEL
+#define DFS_LOG_COMPILE_LEVEL LL_DEBUG3
+#endif
+
+extern dfs_log_level_e DFS_LOG_LEVEL;
+
+/** Longest message kept per record; longer messages are truncated **/
+const size_t DFS_LOG_TEXT_SIZE = 232;
+
+struct DFSLogEntry {
+    int level;
+    int line;
+    const char* file;
+    int64_t timestamp_us;
+    size_t length;
+    char text[DFS_LOG_TEXT_SIZE];
+};
+
+/** Single-producer single-consumer ring of log records owned by one thread **/
+class DFSLogRing {
+
+public:
+    static const size_t CAPACITY = 256;
+
+private:
+    DFSLogEntry entries[CAPACITY];
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+
+public:
+    std::atomic<uint64_t> dropped{0};
+
+    bool Push(const DFSLogEntry& entry) {
+        size_t write = tail.load(std::memory_order_relaxed);
+        if (write - head.load(std::memory_order_acquire) == CAPACITY) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        DFSLogEntry& slot = entries[write % CAPACITY];
+        slot.level = entry.level;
+        slot.line = entry.line;
+        slot.file = entry.file;
+        slot.timestamp_us = entry.timestamp_us;
+        slot.length = entry.length;
+        memcpy(slot.text, entry.text, entry.length);
+        tail.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Empty() const {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_relaxed);
+    }
+
+    bool Pop(DFSLogEntry* entry) {
+        size_t read = head.load(std::memory_order_relaxed);
+        if (read == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        const DFSLogEntry& slot = entries[read % CAPACITY];
+        *entry = slot;
+        head.store(read + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/** Ring of the calling thread, taken from the drain on first use and handed back when the thread exits **/
+DFSLogRing& dfs_log_ring();
+
+/** Queues a record on the calling thread's ring and wakes the drain thread if it is idle **/
+void dfs_log_submit(const DFSLogEntry& entry);
+
+/** Blocks until every record logged so far has been written **/
+void dfs_log_flush();
+
+/** streambuf over a fixed buffer that silently truncates instead of allocating **/
+class DFSLogBuffer : public std::streambuf {
+
+public:
+    DFSLogBuffer(char* buffer, size_t size) {
+        setp(buffer, buffer + size);
+    }
+
+    size_t Length() const {
+        return pptr() - pbase();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+};
+
+class DFSLogRecord {
+
+private:
+    DFSLogEntry entry;
+    DFSLogBuffer buffer;
+    std::ostream out;
+
+public:
+    DFSLogRecord(dfs_log_level_e level, const char* file, int line)
+        : buffer(entry.text, DFS_LOG_TEXT_SIZE), out(&buffer) {
+        entry.level = level;
+        entry.file = file;
+        entry.line = line;
+        entry.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    ~DFSLogRecord() {
+        entry.length = buffer.Length();
+        dfs_log_submit(entry);
+    }
+
+    std::ostream& stream() {
+        return out;
+    }
+};
+
+/** Turns the streamed expression into void so both branches of the ?: match **/
+struct DFSLogVoidify {
+    void operator&(std::ostream&) {}
+};
+
+#define dfs_log_enabled(level) \
+    ((level) <= DFS_LOG_COMPILE_LEVEL && (level) <= DFS_LOG_LEVEL)
+
+#undef dfs_log
+#define dfs_log(level) \
+    !dfs_log_enabled(level) ? (void) 0 : DFSLogVoidify() & DFSLogRecord(level, __FILE__, __LINE__).stream()
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef DFSLIB_MANIFEST_P2_H
+#define DFSLIB_MANIFEST_P2_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <functional>
+#include <sys/stat.h>
+
+#include "dfslib-staged-p2.h"
+
+/** Attributes of one file as recorded in a manifest **/
+struct ManifestEntry {
+    std::string name;
+    int64_t size = 0;
+    int64_t mtime = 0;
+    uint32_t crc = 0;
+};
+
+/**
+ * Merkle tree over the (name, size, mtime, crc) of every file in a mount.
+ *
+ * Files are spread over FANOUT^DEPTH leaf buckets by a hash of their name.
+ * A bucket's hash is the XOR of its entries' hashes, so adding, changing or
+ * removing a file only touches one bucket plus DEPTH inner nodes. Two sides
+ * reconcile by comparing hashes top-down and descending only into subtrees
+ * that differ; node (level, index) covers children index * FANOUT .. + FANOUT - 1
+ * of the next level, and level DEPTH holds the buckets.
+ */
+class Manifest {
+
+public:
+    static const int FANOUT = 16;
+    static const int DEPTH = 3;
+
+private:
+    /** Node hashes per level, levels[DEPTH] being the buckets **/
+    std::vector<std::vector<uint64_t>> levels;
+
+    /** File entries per bucket **/
+    std::vector<std::map<std::string, ManifestEntry>> buckets;
+
+    /** Whether the entries differ from the last file saved or loaded; saving does not change them, hence mutable **/
+    mutable bool unsaved = false;
+
+    mutable std::mutex manifest_m;
+
+    static uint64_t Fnv1a(const void* data, size_t length, uint64_t hash = 1469598103934665603ULL) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < length; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    static uint64_t EntryHash(const ManifestEntry& entry) {
+        uint64_t hash = Fnv1a(entry.name.data(), entry.name.size() + 1);
+        hash = Fnv1a(&entry.size, sizeof(entry.size), hash);
+        hash = Fnv1a(&entry.mtime, sizeof(entry.mtime), hash);
+        return Fnv1a(&entry.crc, sizeof(entry.crc), hash);
+    }
+
+    /** Recomputes the inner nodes above a bucket after its hash changed **/
+    void Propagate(int bucket) {
+        int index = bucket;
+        for (int level = DEPTH - 1; level >= 0; --level) {
+            index /= FANOUT;
+            const uint64_t* children = &levels[level + 1][index * FANOUT];
+            levels[level][index] = Fnv1a(children, FANOUT * sizeof(uint64_t));
+        }
+    }
+
+    void UpsertLocked(const ManifestEntry& entry) {
+        int bucket = BucketOf(entry.name);
+        std::map<std::string, ManifestEntry>::iterator it = buckets[bucket].find(entry.name);
+        if (it != buckets[bucket].end()) {
+            if (EntryHash(it->second) == EntryHash(entry)) {
+                return;
+            }
+            levels[DEPTH][bucket] ^= EntryHash(it->second);
+            it->second = entry;
+        } else {
+            buckets[bucket].emplace(entry.name, entry);
+        }
+        levels[DEPTH][bucket] ^= EntryHash(entry);
+        Propagate(bucket);
+        unsaved = true;
+    }
+
+    void RemoveLocked(const std::string& name) {
+        int bucket = BucketOf(name);
+        std::map<std::string, ManifestEntry>::iterator it = buckets[bucket].find(name);
+        if (it == buckets[bucket].end()) {
+            return;
+        }
+        levels[DEPTH][bucket] ^= EntryHash(it->second);
+        buckets[bucket].erase(it);
+        Propagate(bucket);
+        unsaved = true;
+    }
+
+public:
+    Manifest() : levels(DEPTH + 1), buckets(Buckets()) {
+        for (int level = 0; level <= DEPTH; ++level) {
+            levels[level].assign(Width(level), 0);
+        }
+        for (int bucket = 0; bucket < Buckets(); bucket += FANOUT) {
+            Propagate(bucket);
+        }
+    }
+
+    /** Number of nodes on a level **/
+    static int Width(int level) {
+        int width = 1;
+        for (int i = 0; i < level; ++i) {
+            width *= FANOUT;
+        }
+        return width;
+    }
+
+    static int Buckets() {
+        return Width(DEPTH);
+    }
+
+    static int BucketOf(const std::string& name) {
+        return static_cast<int>(Fnv1a(name.data(), name.size()) % Buckets());
+    }
+
+    void Upsert(const ManifestEntry& entry) {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        UpsertLocked(entry);
+    }
+
+    void Remove(const std::string& name) {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        RemoveLocked(name);
+    }
+
+    /** True if entries changed since the last Save or Load **/
+    bool Unsaved() const {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        return unsaved;
+    }
+
+    bool Get(const std::string& name, ManifestEntry* entry) const {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        const std::map<std::string, ManifestEntry>& bucket = buckets[BucketOf(name)];
+        std::map<std::string, ManifestEntry>::const_iterator it = bucket.find(name);
+        if (it == bucket.end()) {
+            return false;
+        }
+        *entry = it->second;
+        return true;
+    }
+
+    uint64_t Root() const {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        return levels[0][0];
+    }
+
+    uint64_t NodeHash(int level, int index) const {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        return levels[level][index];
+    }
+
+    std::vector<ManifestEntry> BucketEntries(int bucket) const {
+        std::lock_guard<std::mutex> lock(manifest_m);
+        std::vector<ManifestEntry> entries;
+        for (const std::pair<const std::string, ManifestEntry>& it : buckets[bucket]) {
+            entries.push_back(it.second);
+        }
+        return entries;
+    }
+
+    /**
+     * Brings the manifest in line with the files under `mount_path`. Checksums
+     * are only recomputed for files whose size or mtime changed, and names that
+     * vanished from disk are removed and returned.
+     */
+    std::vector<ManifestEntry> Refresh(const std::string& mount_path,
+                                       const std::function<uint32_t(const std::string&)>& checksum) {
+        std::set<std::string> seen;
+        DIR* dir = opendir(mount_path.c_str());
+        if (dir) {
+            struct dirent* dir_entry;
+            while ((dir_entry = readdir(dir)) != nullptr) {
+                std::string path = mount_path + "/" + dir_entry->d_name;
+                struct stat file_stats;
+                if (is_staged_file(dir_entry->d_name) || stat(path.c_str(), &file_stats) != 0 || !S_ISREG(file_stats.st_mode)) {
+                    continue;
+                }
+                seen.insert(dir_entry->d_name);
+
+                ManifestEntry entry;
+                if (Get(dir_entry->d_name, &entry) && entry.size == file_stats.st_size && entry.mtime == file_stats.st_mtime) {
+                    continue;
+                }
+                entry.name = dir_entry->d_name;
+                entry.size = file_stats.st_size;
+                entry.mtime = file_stats.st_mtime;
+                entry.crc = checksum(path);
+                Upsert(entry);
+            }
+            closedir(dir);
+        }
+
+        std::vector<ManifestEntry> removed;
+        std::lock_guard<std::mutex> lock(manifest_m);
+        for (const std::map<std::string, ManifestEntry>& bucket : buckets) {
+            for (const std::pair<const std::string, ManifestEntry>& it : bucket) {
+                if (seen.count(it.first) == 0) {
+                    removed.push_back(it.second);
+                }
+            }
+        }
+        for (const ManifestEntry& entry : removed) {
+            RemoveLocked(entry.name);
+        }
+        return removed;
+    }
+
+    bool Save(const std::string& path) const {
+        std::string temp_path = path + ".tmp";
+        std::ofstream ofs(temp_path, std::ios::trunc);
+        if (!ofs.is_open()) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(manifest_m);
+        ofs << "DFSMANIFEST 1\n";
+        for (const std::map<std::string, ManifestEntry>& bucket : buckets) {
+            for (const std::pair<const std::string, ManifestEntry>& it : bucket) {
+                ofs << it.second.crc << ' ' << it.second.size << ' ' << it.second.mtime << ' ' << it.second.name << '\n';
+            }
+        }
+        ofs.close();
+        if (!ofs || rename(temp_path.c_str(), path.c_str()) != 0) {
+            return false;
+        }
+        unsaved = false;
+        return true;
+    }
+
+    bool Load(const std::string& path) {
+        std::ifstream ifs(path);
+        std::string line;
+        if (!ifs.is_open() || !std::getline(ifs, line) || line != "DFSMANIFEST 1") {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(manifest_m);
+        // Loading into a manifest that already has entries leaves it different from the file
+        bool merged = unsaved;
+        for (const std::map<std::string, ManifestEntry>& bucket : buckets) {
+            merged = merged || !bucket.empty();
+        }
+        while (std::getline(ifs, line)) {
+            std::istringstream fields(line);
+            ManifestEntry entry;
+            if (!(fields >> entry.crc >> entry.size >> entry.mtime) || !std::getline(fields >> std::ws, entry.name)) {
+                continue;
+            }
+            UpsertLocked(entry);
+        }
+        unsaved = merged;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef DFSLIB_METRICS_P2_H
+#define DFSLIB_METRICS_P2_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+
+#include "dfslib-histogram-p2.h"
+
+/** Number of per-thread shards behind every counter and histogram **/
+const int METRIC_SHARDS = 8;
+
+/** Shard owned by the calling thread, assigned round-robin on first use **/
+inline int metric_shard() {
+    static std::atomic<int> next_shard{0};
+    static thread_local int shard = next_shard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+/** Counter split into per-thread shards whose values sit a cache line apart **/
+class ShardedCounter {
+
+private:
+    // Padding rather than alignas: over-aligned new is not available before C++17
+    struct Shard {
+        std::atomic<uint64_t> value{0};
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    Shard shards[METRIC_SHARDS];
+
+public:
+    void Add(uint64_t amount = 1) {
+        shards[metric_shard()].value.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t Value() const {
+        uint64_t total = 0;
+        for (const Shard& shard : shards) {
+            total += shard.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+/** Latency histogram split into per-thread shards, merged on read **/
+class ShardedHistogram {
+
+private:
+    std::unique_ptr<LatencyHistogram[]> shards{new LatencyHistogram[METRIC_SHARDS]};
+
+public:
+    void Record(uint64_t value) {
+        shards[metric_shard()].Record(value);
+    }
+
+    /** Records the microseconds elapsed since `start` **/
+    void RecordSince(std::chrono::steady_clock::time_point start) {
+        Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::unique_ptr<LatencyHistogram> Snapshot() const {
+        std::unique_ptr<LatencyHistogram> merged(new LatencyHistogram());
+        for (int i = 0; i < METRIC_SHARDS; ++i) {
+            merged->Merge(shards[i]);
+        }
+        return merged;
+    }
+};
+
+/** Times a scope in microseconds into a histogram **/
+class ScopedTimer {
+
+private:
+    ShardedHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(ShardedHistogram& histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer() {
+        histogram.RecordSince(start);
+    }
+};
+
+/**
+ * Mutex that records how long each acquisition waited for it and then held
+ * it. The timing lives in lock() and unlock(), so it covers every
+ * lock_guard or unique_lock that takes the mutex and adds no second
+ * acquisition of its own.
+ */
+class TimedMutex {
+
+private:
+    std::mutex mutex;
+    ShardedHistogram& wait_time;
+    ShardedHistogram& hold_time;
+
+    /** Written and read only by the current holder **/
+    std::chrono::steady_clock::time_point acquired;
+
+public:
+    TimedMutex(ShardedHistogram& wait_time, ShardedHistogram& hold_time)
+        : wait_time(wait_time), hold_time(hold_time) {}
+
+    TimedMutex(const TimedMutex&) = delete;
+    TimedMutex& operator=(const TimedMutex&) = delete;
+
+    void lock() {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mutex.lock();
+        acquired = std::chrono::steady_clock::now();
+        wait_time.Record(std::chrono::duration_cast<std::chrono::microseconds>(acquired - start).count());
+    }
+
+    bool try_lock() {
+        if (!mutex.try_lock()) {
+            return false;
+        }
+        acquired = std::chrono::steady_clock::now();
+        wait_time.Record(0);
+        return true;
+    }
+
+    void unlock() {
+        hold_time.RecordSince(acquired);
+        mutex.unlock();
+    }
+};
+
+/** Most recently set value of a quantity, such as the current chunk size **/
+class Gauge {
+
+private:
+    std::atomic<int64_t> value{0};
+
+public:
+    void Set(int64_t current) {
+        value.store(current, std::memory_order_relaxed);
+    }
+
+    int64_t Value() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+/** Counters kept for every RPC method **/
+struct RpcMetrics {
+    ShardedCounter calls;
+    ShardedCounter errors;
+    ShardedCounter bytes_in;
+    ShardedCounter bytes_out;
+    ShardedCounter chunks;
+    ShardedHistogram latency;
+};
+
+/**
+ * Server-wide metrics registry.
+ *
+ * RPC entries are created up front by RegisterRpc, so lookups on the hot path
+ * read an immutable map and take no lock. Named timers cover the internals
+ * (lock wait/hold, disk, CRC) that per-RPC latency alone cannot explain.
+ */
+class DFSMetrics {
+
+private:
+    std::map<std::string, std::unique_ptr<RpcMetrics>> rpcs;
+    RpcMetrics unknown_rpc;
+
+public:
+    ShardedHistogram master_lock_wait;
+    ShardedHistogram master_lock_hold;
+    ShardedHistogram disk_read;
+    ShardedHistogram disk_write;
+    ShardedHistogram crc;
+
+    /** Size picked for the latest chunk sent by any adaptive transfer **/
+    Gauge chunk_size;
+
+    /** Registers a method by its short name; must happen before serving **/
+    void RegisterRpc(const std::string& method) {
+        rpcs[method].reset(new RpcMetrics());
+    }
+
+    /** Accepts either a short name or a full "/package.Service/Method" path **/
+    RpcMetrics& Rpc(const std::string& method) {
+        std::string::size_type slash = method.rfind('/');
+        std::map<std::string, std::unique_ptr<RpcMetrics>>::iterator it =
+            rpcs.find(slash == std::string::npos ? method : method.substr(slash + 1));
+        return it == rpcs.end() ? unknown_rpc : *it->second;
+    }
+
+    const std::map<std::string, std::unique_ptr<RpcMetrics>>& Rpcs() const {
+        return rpcs;
+    }
+
+    std::vector<std::pair<std::string, const ShardedHistogram*>> Timers() const {
+        return {
+            {"master_lock_wait", &master_lock_wait},
+            {"master_lock_hold", &master_lock_hold},
+            {"disk_read", &disk_read},
+            {"disk_write", &disk_write},
+            {"crc", &crc},
+        };
+    }
+
+    std::vector<std::pair<std::string, const Gauge*>> Gauges() const {
+        return {
+            {"chunk_size_bytes", &chunk_size},
+        };
+    }
+
+    /** Writes every metric in Prometheus text format, replacing `path` atomically **/
+    bool WritePrometheus(const std::string& path) const {
+        std::string temp_path = path + ".tmp";
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+        out << "# TYPE dfs_rpc_calls_total counter\n"
+            << "# TYPE dfs_rpc_errors_total counter\n"
+            << "# TYPE dfs_rpc_bytes_in_total counter\n"
+            << "# TYPE dfs_rpc_bytes_out_total counter\n"
+            << "# TYPE dfs_rpc_chunks_total counter\n"
+            << "# TYPE dfs_rpc_latency_us summary\n";
+        for (const std::pair<const std::string, std::unique_ptr<RpcMetrics>>& rpc : rpcs) {
+            const std::string label = "{method=\"" + rpc.first + "\"";
+            out << "dfs_rpc_calls_total" << label << "} " << rpc.second->calls.Value() << "\n"
+                << "dfs_rpc_errors_total" << label << "} " << rpc.second->errors.Value() << "\n"
+                << "dfs_rpc_bytes_in_total" << label << "} " << rpc.second->bytes_in.Value() << "\n"
+                << "dfs_rpc_bytes_out_total" << label << "} " << rpc.second->bytes_out.Value() << "\n"
+                << "dfs_rpc_chunks_total" << label << "} " << rpc.second->chunks.Value() << "\n";
+
+            std::unique_ptr<LatencyHistogram> latency = rpc.second->latency.Snapshot();
+            for (double quantile : QUANTILES) {
+                out << "dfs_rpc_latency_us" << label << ",quantile=\"" << quantile << "\"} "
+                    << latency->Percentile(quantile * 100) << "\n";
+            }
+            out << "dfs_rpc_latency_us_sum" << label << "} " << latency->Mean() * latency->Count() << "\n"
+                << "dfs_rpc_latency_us_count" << label << "} " << latency->Count() << "\n";
+        }
+
+        out << "# TYPE dfs_timer_us summary\n";
+        for (const std::pair<std::string, const ShardedHistogram*>& timer : Timers()) {
+            const std::string label = "{timer=\"" + timer.first + "\"";
+            std::unique_ptr<LatencyHistogram> latency = timer.second->Snapshot();
+            for (double quantile : QUANTILES) {
+                out << "dfs_timer_us" << label << ",quantile=\"" << quantile << "\"} "
+                    << latency->Percentile(quantile * 100) << "\n";
+            }
+            out << "dfs_timer_us_sum" << label << "} " << latency->Mean() * latency->Count() << "\n"
+                << "dfs_timer_us_count" << label << "} " << latency->Count() << "\n";
+        }
+
+        for (const std::pair<std::string, const Gauge*>& gauge : Gauges()) {
+            out << "# TYPE dfs_" << gauge.first << " gauge\n"
+                << "dfs_" << gauge.first << " " << gauge.second->Value() << "\n";
+        }
+
+        out.close();
+        return out && rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+};
+
+#endif
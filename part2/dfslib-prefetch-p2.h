@@ -0,0 +1,404 @@
+#ifndef DFSLIB_PREFETCH_P2_H
+#define DFSLIB_PREFETCH_P2_H
+
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "dfslib-scheduler-p2.h"
+
+struct PrefetchOptions {
+    /** Bandwidth budget for background fetches, in bytes per second **/
+    double bytes_per_sec = 4 * 1024 * 1024;
+    double burst_bytes = 16 * 1024 * 1024;
+
+    /** Accesses this close together count as one co-access **/
+    std::chrono::milliseconds co_access_window{5000};
+
+    /** Score a related file needs before it is prefetched **/
+    double min_score = 2;
+
+    /** Score given to a file for sharing the accessed file's directory **/
+    double directory_weight = 2;
+
+    /** Related files queued per access **/
+    size_t max_candidates = 8;
+
+    /** Bounds on the learned model and the fetch queue **/
+    size_t max_tracked_files = 4096;
+    size_t max_neighbours = 16;
+    size_t max_queue = 256;
+};
+
+/**
+ * Files being fetched right now. The sync loop and the prefetcher share one
+ * set, so a file is never downloaded twice at once.
+ */
+class InFlightFetches {
+
+private:
+    std::mutex fetches_m;
+    std::condition_variable done_cv;
+    std::set<std::string> names;
+
+public:
+    /** Marks a file as being fetched for the lifetime of the scope **/
+    class Scope {
+
+    private:
+        InFlightFetches& fetches;
+        std::string name;
+        bool owned;
+
+    public:
+        /** Waits for a fetch of the same file to finish first, or gives up at once if `wait` is false **/
+        Scope(InFlightFetches& fetches, const std::string& name, bool wait = true)
+            : fetches(fetches), name(name) {
+            std::unique_lock<std::mutex> lock(fetches.fetches_m);
+            if (wait) {
+                fetches.done_cv.wait(lock, [&] { return fetches.names.count(name) == 0; });
+            }
+            owned = fetches.names.insert(name).second;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            if (!owned) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(fetches.fetches_m);
+                fetches.names.erase(name);
+            }
+            fetches.done_cv.notify_all();
+        }
+
+        bool Owned() const {
+            return owned;
+        }
+    };
+};
+
+/**
+ * Learns which files are used together and fetches them ahead of time.
+ *
+ * Every access reported by the client's inotify watcher is paired with the
+ * other files accessed within `co_access_window`, and each pair's score is
+ * raised. Files in the same directory are related as well. In a flat mount,
+ * that means files that share a base name, such as notes.tex and notes.pdf.
+ * After an access, related files whose server copy is newer than the local
+ * one are queued. A single background thread fetches them under a token
+ * bucket budget, and it yields whenever a foreground transfer is running.
+ * Events caused by the client's own reads and writes, including the
+ * prefetcher's fetches, are ignored, so it does not learn from itself.
+ */
+class Prefetcher {
+
+public:
+    /** Fetches a file into the local cache; returns false if it could not **/
+    typedef std::function<bool(const std::string&)> FetchFunction;
+
+    /** Modification time of the local copy, 0 if there is none **/
+    typedef std::function<int64_t(const std::string&)> LocalMtimeFunction;
+
+    /** Marks a user-facing transfer, during which prefetching pauses **/
+    class ForegroundScope {
+
+    private:
+        Prefetcher* prefetcher;
+
+    public:
+        explicit ForegroundScope(Prefetcher* prefetcher) : prefetcher(prefetcher) {
+            if (prefetcher) {
+                prefetcher->foreground.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        ~ForegroundScope() {
+            if (prefetcher) {
+                prefetcher->foreground.fetch_sub(1, std::memory_order_relaxed);
+                prefetcher->queue_cv.notify_one();
+            }
+        }
+    };
+
+private:
+    struct RemoteFile {
+        int64_t mtime = 0;
+        int64_t size = 0;
+    };
+
+    struct FileModel {
+        std::map<std::string, double> neighbours;
+        std::chrono::steady_clock::time_point last_seen;
+    };
+
+    PrefetchOptions options;
+    FetchFunction fetch;
+    LocalMtimeFunction local_mtime;
+
+    std::mutex prefetch_m;
+    std::condition_variable queue_cv;
+    std::unordered_map<std::string, FileModel> model;
+    std::unordered_map<std::string, std::set<std::string>> directories;
+    std::unordered_map<std::string, RemoteFile> remote;
+    std::deque<std::pair<std::string, std::chrono::steady_clock::time_point>> recent;
+    std::map<std::string, std::chrono::steady_clock::time_point> ignore_until;
+    std::deque<std::string> queue;
+    std::set<std::string> queued;
+    TokenBucket budget;
+
+    std::atomic<int> foreground{0};
+    bool stop = false;
+    std::thread worker;
+
+    /** Score above which a file's neighbour scores are halved, so old habits fade **/
+    static constexpr double MAX_SCORE = 64;
+
+    /** Directory of a name, or its base name up to the first '.' in a flat mount **/
+    static std::string DirectoryOf(const std::string& name) {
+        std::string::size_type slash = name.rfind('/');
+        if (slash != std::string::npos) {
+            return name.substr(0, slash + 1);
+        }
+        return name.substr(0, name.find('.'));
+    }
+
+    FileModel& Track(const std::string& name, std::chrono::steady_clock::time_point now) {
+        std::unordered_map<std::string, FileModel>::iterator it = model.find(name);
+        if (it == model.end() && model.size() >= options.max_tracked_files) {
+            std::unordered_map<std::string, FileModel>::iterator oldest = model.begin();
+            for (std::unordered_map<std::string, FileModel>::iterator candidate = model.begin(); candidate != model.end(); ++candidate) {
+                if (candidate->second.last_seen < oldest->second.last_seen) {
+                    oldest = candidate;
+                }
+            }
+            model.erase(oldest);
+        }
+        FileModel& file = model[name];
+        file.last_seen = now;
+        return file;
+    }
+
+    void Bump(FileModel& file, const std::string& neighbour) {
+        std::map<std::string, double>::iterator it = file.neighbours.find(neighbour);
+        if (it == file.neighbours.end()) {
+            if (file.neighbours.size() >= options.max_neighbours) {
+                std::map<std::string, double>::iterator weakest = std::min_element(file.neighbours.begin(), file.neighbours.end(),
+                    [](const std::pair<const std::string, double>& a, const std::pair<const std::string, double>& b) {
+                        return a.second < b.second;
+                    });
+                file.neighbours.erase(weakest);
+            }
+            it = file.neighbours.emplace(neighbour, 0).first;
+        }
+        it->second += 1;
+        if (it->second >= MAX_SCORE) {
+            for (std::pair<const std::string, double>& entry : file.neighbours) {
+                entry.second /= 2;
+            }
+        }
+    }
+
+    double Score(const std::string& from, const std::string& to) const {
+        double score = DirectoryOf(from) == DirectoryOf(to) ? options.directory_weight : 0;
+        std::unordered_map<std::string, FileModel>::const_iterator file = model.find(from);
+        if (file != model.end()) {
+            std::map<std::string, double>::const_iterator neighbour = file->second.neighbours.find(to);
+            if (neighbour != file->second.neighbours.end()) {
+                score += neighbour->second;
+            }
+        }
+        return score;
+    }
+
+    bool StaleLocked(const std::string& name) const {
+        std::unordered_map<std::string, RemoteFile>::const_iterator it = remote.find(name);
+        return it != remote.end() && it->second.mtime > local_mtime(name);
+    }
+
+    void EnqueueLocked(const std::string& name) {
+        if (queue.size() >= options.max_queue || !queued.insert(name).second) {
+            return;
+        }
+        queue.push_back(name);
+        queue_cv.notify_one();
+    }
+
+    /** Queues the stale files most strongly related to `name` **/
+    void QueueRelatedLocked(const std::string& name) {
+        std::set<std::string> related;
+        std::unordered_map<std::string, FileModel>::const_iterator file = model.find(name);
+        if (file != model.end()) {
+            for (const std::pair<const std::string, double>& neighbour : file->second.neighbours) {
+                related.insert(neighbour.first);
+            }
+        }
+        std::unordered_map<std::string, std::set<std::string>>::const_iterator directory = directories.find(DirectoryOf(name));
+        if (directory != directories.end()) {
+            related.insert(directory->second.begin(), directory->second.end());
+        }
+        related.erase(name);
+
+        std::vector<std::pair<double, std::string>> candidates;
+        for (const std::string& candidate : related) {
+            double score = Score(name, candidate);
+            if (score >= options.min_score && queued.count(candidate) == 0 && StaleLocked(candidate)) {
+                candidates.emplace_back(score, candidate);
+            }
+        }
+        // Highest score first, ties to the most recently changed file
+        std::sort(candidates.begin(), candidates.end(),
+            [this](const std::pair<double, std::string>& a, const std::pair<double, std::string>& b) {
+                if (a.first != b.first) {
+                    return a.first > b.first;
+                }
+                return remote.at(a.second).mtime > remote.at(b.second).mtime;
+            });
+        if (candidates.size() > options.max_candidates) {
+            candidates.resize(options.max_candidates);
+        }
+        for (const std::pair<double, std::string>& candidate : candidates) {
+            EnqueueLocked(candidate.second);
+        }
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(prefetch_m);
+        while (!stop) {
+            if (queue.empty() || foreground.load(std::memory_order_relaxed) > 0) {
+                // Polls while paused, since foreground transfers end without taking the lock
+                queue_cv.wait_for(lock, std::chrono::milliseconds(50));
+                continue;
+            }
+
+            std::string name = queue.front();
+            if (!StaleLocked(name)) {
+                queue.pop_front();
+                queued.erase(name);
+                continue;
+            }
+            double size = static_cast<double>(remote[name].size);
+            if (!budget.TryTake(size)) {
+                queue_cv.wait_for(lock, budget.Wait(size));
+                continue;
+            }
+            queue.pop_front();
+
+            // The fetch writes the file, so its own inotify events must not count as accesses
+            ignore_until[name] = std::chrono::steady_clock::now() + options.co_access_window;
+            lock.unlock();
+            bool fetched = fetch(name);
+            lock.lock();
+
+            queued.erase(name);
+            if (!fetched) {
+                remote.erase(name);
+            }
+        }
+    }
+
+public:
+    Prefetcher(const PrefetchOptions& options, FetchFunction fetch, LocalMtimeFunction local_mtime)
+        : options(options), fetch(fetch), local_mtime(local_mtime),
+          budget(options.bytes_per_sec, options.burst_bytes) {
+        worker = std::thread(&Prefetcher::Run, this);
+    }
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(prefetch_m);
+            stop = true;
+        }
+        queue_cv.notify_one();
+        worker.join();
+    }
+
+    /** Records an access to `name` by the user and queues related stale files **/
+    void Observe(const std::string& name) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(prefetch_m);
+
+        std::map<std::string, std::chrono::steady_clock::time_point>::iterator ignored = ignore_until.find(name);
+        if (ignored != ignore_until.end()) {
+            if (now < ignored->second) {
+                return;
+            }
+            ignore_until.erase(ignored);
+        }
+
+        while (!recent.empty() && now - recent.front().second > options.co_access_window) {
+            recent.pop_front();
+        }
+
+        // Repeated events for a file already in the window only refresh it, so a pair counts once per window
+        bool seen = false;
+        for (std::pair<std::string, std::chrono::steady_clock::time_point>& entry : recent) {
+            if (entry.first == name) {
+                entry.second = now;
+                seen = true;
+            }
+        }
+        if (!seen) {
+            FileModel& file = Track(name, now);
+            for (const std::pair<std::string, std::chrono::steady_clock::time_point>& entry : recent) {
+                Bump(file, entry.first);
+                Bump(Track(entry.first, now), name);
+            }
+            recent.emplace_back(name, now);
+        }
+
+        directories[DirectoryOf(name)].insert(name);
+        QueueRelatedLocked(name);
+    }
+
+    /** Records the server's copy of a file, as reported by a listing or callback **/
+    void NoteRemote(const std::string& name, int64_t mtime, int64_t size) {
+        std::lock_guard<std::mutex> lock(prefetch_m);
+        RemoteFile& file = remote[name];
+        bool changed = mtime > file.mtime;
+        file.mtime = mtime;
+        file.size = size;
+        directories[DirectoryOf(name)].insert(name);
+
+        // A file that changes while a related one is in use is fetched right away
+        if (!changed || !StaleLocked(name)) {
+            return;
+        }
+        for (const std::pair<std::string, std::chrono::steady_clock::time_point>& entry : recent) {
+            if (entry.first != name && Score(entry.first, name) >= options.min_score) {
+                EnqueueLocked(name);
+                return;
+            }
+        }
+    }
+
+    /** Marks a file as just opened or written by the client itself, so the resulting inotify events are not learned **/
+    void NoteOwnAccess(const std::string& name) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(prefetch_m);
+        if (ignore_until.size() >= options.max_tracked_files) {
+            for (std::map<std::string, std::chrono::steady_clock::time_point>::iterator it = ignore_until.begin(); it != ignore_until.end(); ) {
+                it = it->second < now ? ignore_until.erase(it) : std::next(it);
+            }
+        }
+        ignore_until[name] = now + options.co_access_window;
+    }
+};
+
+#endif
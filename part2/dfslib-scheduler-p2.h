@@ -0,0 +1,272 @@
+#ifndef DFSLIB_SCHEDULER_P2_H
+#define DFSLIB_SCHEDULER_P2_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <chrono>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <condition_variable>
+
+/**
+ * Classic token bucket. Tokens refill continuously at `rate` per second up to
+ * `burst`. A rate of 0 disables the limit. Not thread safe on its own.
+ */
+class TokenBucket {
+
+private:
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last_refill;
+
+    void Refill() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - last_refill;
+        tokens = std::min(burst, tokens + elapsed.count() * rate);
+        last_refill = now;
+    }
+
+public:
+    TokenBucket(double rate = 0, double burst = 0)
+        : rate(rate), burst(burst), tokens(burst), last_refill(std::chrono::steady_clock::now()) {}
+
+    bool Unlimited() const {
+        return rate <= 0;
+    }
+
+    bool TryTake(double amount) {
+        if (Unlimited()) {
+            return true;
+        }
+        Refill();
+        // Requests larger than the burst are let through once the bucket is full
+        if (tokens >= std::min(amount, burst)) {
+            tokens -= amount;
+            return true;
+        }
+        return false;
+    }
+
+    /** Time until `amount` tokens could be taken **/
+    std::chrono::milliseconds Wait(double amount) {
+        if (Unlimited()) {
+            return std::chrono::milliseconds(0);
+        }
+        Refill();
+        double deficit = std::min(amount, burst) - tokens;
+        if (deficit <= 0) {
+            return std::chrono::milliseconds(0);
+        }
+        return std::chrono::milliseconds(static_cast<long>(deficit * 1000 / rate) + 1);
+    }
+};
+
+/** Minimum interval between sweeps of idle per-client scheduler state **/
+const int SCHEDULER_SWEEP_SECONDS = 10;
+
+/** Limits applied by the FairScheduler; 0 disables a limit **/
+struct SchedulerOptions {
+    /** Concurrent bulk transfers; keeps server threads free for metadata calls **/
+    int max_bulk_streams = 8;
+
+    /** Retry hint sent with a transfer rejected for lack of a stream slot **/
+    long bulk_retry_after_ms = 100;
+
+    /** Bandwidth shared by all bulk transfers, in bytes per second **/
+    double bulk_bytes_per_sec = 0;
+    double bulk_burst_bytes = 4 * 1024 * 1024;
+
+    /** Metadata calls allowed per client, in calls per second **/
+    double metadata_ops_per_sec = 0;
+    double metadata_burst = 50;
+};
+
+/**
+ * Server-side QoS for two priority classes.
+ *
+ * Metadata calls (locks, status, listings) are only subject to a per-client
+ * token bucket and never queue behind transfers. Bulk transfers hold one of
+ * a fixed number of stream slots and request bandwidth per chunk; chunks are
+ * granted in weighted fair queuing order (smallest virtual finish tag first)
+ * out of a shared token bucket, so each client receives its weighted share of
+ * the bulk bandwidth regardless of how many streams it opens.
+ */
+class FairScheduler {
+
+private:
+    struct ClientState {
+        double weight = 1.0;
+        double finish_tag = 0;
+        int active_streams = 0;
+        TokenBucket metadata_bucket;
+    };
+
+    SchedulerOptions options;
+
+    /**
+     * Per-client state, keyed by client ID. Entries are dropped once a client
+     * has no streams and its state is back to what a new entry would hold.
+     */
+    std::map<std::string, ClientState> clients;
+
+    /** Weights configured ahead of a client's first call **/
+    std::map<std::string, double> weights;
+
+    /** Chunk requests waiting for bandwidth, ordered by (finish tag, arrival) **/
+    std::set<std::pair<double, unsigned long>> waiting;
+
+    TokenBucket bulk_bucket;
+    double virtual_time = 0;
+    unsigned long arrivals = 0;
+    int bulk_streams = 0;
+
+    std::chrono::steady_clock::time_point last_sweep = std::chrono::steady_clock::now();
+
+    std::mutex scheduler_m;
+    std::condition_variable scheduler_cv;
+
+    ClientState& Client(const std::string& client_id) {
+        std::map<std::string, ClientState>::iterator it = clients.find(client_id);
+        if (it == clients.end()) {
+            it = clients.emplace(client_id, ClientState()).first;
+            std::map<std::string, double>::const_iterator weight = weights.find(client_id);
+            it->second.weight = weight == weights.end() ? 1.0 : weight->second;
+            it->second.metadata_bucket = TokenBucket(options.metadata_ops_per_sec, options.metadata_burst);
+        }
+        return it->second;
+    }
+
+    /** A full metadata bucket and no stream or queued chunk means the entry holds nothing a new one would not **/
+    bool Idle(ClientState& state) {
+        return state.active_streams == 0 && state.finish_tag <= virtual_time &&
+               state.metadata_bucket.Wait(options.metadata_burst).count() == 0;
+    }
+
+    void EvictIfIdle(std::map<std::string, ClientState>::iterator it) {
+        if (Idle(it->second)) {
+            clients.erase(it);
+        }
+    }
+
+    /** Sweeps every entry, at most once per sweep interval **/
+    void EvictIdle() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - last_sweep < std::chrono::seconds(SCHEDULER_SWEEP_SECONDS)) {
+            return;
+        }
+        last_sweep = now;
+        for (std::map<std::string, ClientState>::iterator it = clients.begin(); it != clients.end(); ) {
+            std::map<std::string, ClientState>::iterator next = std::next(it);
+            EvictIfIdle(it);
+            it = next;
+        }
+    }
+
+public:
+    explicit FairScheduler(const SchedulerOptions& options = SchedulerOptions())
+        : options(options), bulk_bucket(options.bulk_bytes_per_sec, options.bulk_burst_bytes) {}
+
+    void SetClientWeight(const std::string& client_id, double weight) {
+        std::lock_guard<std::mutex> lock(scheduler_m);
+        weights[client_id] = weight;
+        std::map<std::string, ClientState>::iterator it = clients.find(client_id);
+        if (it != clients.end()) {
+            it->second.weight = weight;
+        }
+    }
+
+    /** Takes one metadata token; on refusal `retry_after` says when one will be available **/
+    bool AdmitMetadata(const std::string& client_id, std::chrono::milliseconds* retry_after) {
+        if (options.metadata_ops_per_sec <= 0) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(scheduler_m);
+        ClientState& state = Client(client_id);
+        if (state.metadata_bucket.TryTake(1)) {
+            // Refilled buckets of other clients would otherwise stay until each client called again
+            EvictIdle();
+            return true;
+        }
+        *retry_after = state.metadata_bucket.Wait(1);
+        return false;
+    }
+
+    /**
+     * Claims a bulk stream slot without waiting. Queuing for a slot would hold
+     * a server thread, which is exactly what the slot cap protects, so a full
+     * server refuses and the client retries after `BulkRetryAfter()`.
+     */
+    bool BeginBulk(const std::string& client_id) {
+        std::lock_guard<std::mutex> lock(scheduler_m);
+        if (bulk_streams >= options.max_bulk_streams) {
+            return false;
+        }
+        bulk_streams++;
+        ClientState& state = Client(client_id);
+        if (state.active_streams++ == 0) {
+            // A client returning from idle must not bank credit from the time it was away
+            state.finish_tag = std::max(state.finish_tag, virtual_time);
+        }
+        return true;
+    }
+
+    std::chrono::milliseconds BulkRetryAfter() const {
+        return std::chrono::milliseconds(options.bulk_retry_after_ms);
+    }
+
+    void EndBulk(const std::string& client_id) {
+        std::lock_guard<std::mutex> lock(scheduler_m);
+        bulk_streams--;
+        std::map<std::string, ClientState>::iterator it = clients.find(client_id);
+        if (it != clients.end()) {
+            --it->second.active_streams;
+            EvictIfIdle(it);
+        }
+        scheduler_cv.notify_all();
+    }
+
+    /** Blocks until `bytes` of bulk bandwidth are granted to this client; false once `deadline` passes **/
+    bool AcquireBulk(const std::string& client_id, size_t bytes, std::chrono::system_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(scheduler_m);
+        if (bulk_bucket.Unlimited()) {
+            return true;
+        }
+
+        ClientState& state = Client(client_id);
+        state.finish_tag = std::max(state.finish_tag, virtual_time) + bytes / state.weight;
+        std::pair<double, unsigned long> ticket(state.finish_tag, arrivals++);
+        waiting.insert(ticket);
+
+        while (true) {
+            std::chrono::system_clock::duration remaining = deadline - std::chrono::system_clock::now();
+            if (remaining <= std::chrono::system_clock::duration::zero()) {
+                // Give up the place in line; the bytes were never sent, so the tag is returned too
+                waiting.erase(ticket);
+                state.finish_tag -= bytes / state.weight;
+                scheduler_cv.notify_all();
+                return false;
+            }
+            // Deadline-free calls report a far-future time point, so waits are capped and re-checked
+            std::chrono::system_clock::duration wait = std::min<std::chrono::system_clock::duration>(remaining, std::chrono::seconds(1));
+
+            if (*waiting.begin() == ticket) {
+                if (bulk_bucket.TryTake(bytes)) {
+                    break;
+                }
+                wait = std::min<std::chrono::system_clock::duration>(wait, bulk_bucket.Wait(bytes));
+            }
+            scheduler_cv.wait_for(lock, wait);
+        }
+
+        waiting.erase(waiting.begin());
+        virtual_time = ticket.first;
+        scheduler_cv.notify_all();
+        return true;
+    }
+};
+
+#endif
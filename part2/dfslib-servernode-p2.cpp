@@ -1,18 +1,38 @@
 #include <map>
+#include <set>
 #include <mutex>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
 #include <shared_mutex>
 #include <chrono>
 #include <cstdio>
 #include <string>
 #include <thread>
+#include <new>
+#include <cstdlib>
 #include <errno.h>
 #include <iostream>
 #include <fstream>
 #include <getopt.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/support/server_interceptor.h>
+#include <google/protobuf/descriptor.h>
 
+#include "dfslib-scheduler-p2.h"
+#include "dfslib-admission-p2.h"
+#include "dfslib-manifest-p2.h"
+#include "dfslib-staged-p2.h"
+#include "dfslib-metrics-p2.h"
+#include "dfslib-chunkpool-p2.h"
+#include "dfslib-chunksizer-p2.h"
+#include "dfslib-log-p2.h"
 
 using grpc::Status;
 using grpc::Server;
@@ -21,9 +41,128 @@ using grpc::ServerReader;
 using grpc::ServerWriter;
 using grpc::ServerContext;
 using grpc::ServerBuilder;
+using grpc::ClientWriter;
+using grpc::ClientContext;
+using grpc::experimental::Interceptor;
+using grpc::experimental::ServerRpcInfo;
+using grpc::experimental::InterceptionHookPoints;
+using grpc::experimental::InterceptorBatchMethods;
+using grpc::experimental::ServerInterceptorFactoryInterface;
 
 using dfs_service::DFSService;
 
+/** Upper bound on the number of ranges in a single ReadRange call **/
+const int MAX_RANGES_PER_CALL = 1024;
+
+#ifdef DFS_COUNT_ALLOCATIONS
+/**
+ * Heap allocations made through the global operator new by any server
+ * thread, reported by GetStats. Comparing it with the chunk counters shows
+ * whether the streaming paths allocate per chunk. Allocations inside gRPC
+ * core go through malloc and are not counted. Replacing operator new affects
+ * the whole process, so it is only built in with -DDFS_COUNT_ALLOCATIONS.
+ */
+static ShardedCounter heap_allocations;
+
+void* operator new(std::size_t size) {
+    heap_allocations.Add();
+    void* block = malloc(size ? size : 1);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept {
+    free(block);
+}
+#endif
+
+/** Metrics registry with an entry for every method of the service **/
+DFSMetrics* new_service_metrics() {
+    DFSMetrics* metrics = new DFSMetrics();
+    const google::protobuf::ServiceDescriptor* service =
+        google::protobuf::DescriptorPool::generated_pool()->FindServiceByName(DFSService::service_full_name());
+    for (int i = 0; service && i < service->method_count(); ++i) {
+        metrics->RegisterRpc(service->method(i)->name());
+    }
+    return metrics;
+}
+
+/** Counts every call and its latency and final status, for sync and async methods alike **/
+class MetricsInterceptor : public Interceptor {
+
+private:
+    RpcMetrics& rpc;
+    chrono::steady_clock::time_point start;
+
+public:
+    MetricsInterceptor(ServerRpcInfo* info, DFSMetrics* metrics)
+        : rpc(metrics->Rpc(info->method())), start(chrono::steady_clock::now()) {}
+
+    void Intercept(InterceptorBatchMethods* methods) override {
+        if (methods->QueryInterceptionHookPoint(InterceptionHookPoints::PRE_SEND_STATUS)) {
+            rpc.calls.Add();
+            if (!methods->GetSendStatus().ok()) {
+                rpc.errors.Add();
+            }
+            rpc.latency.RecordSince(start);
+        }
+        methods->Proceed();
+    }
+};
+
+class MetricsInterceptorFactory : public ServerInterceptorFactoryInterface {
+
+private:
+    DFSMetrics* metrics;
+
+public:
+    explicit MetricsInterceptorFactory(DFSMetrics* metrics) : metrics(metrics) {}
+
+    Interceptor* CreateServerInterceptor(ServerRpcInfo* info) override {
+        return new MetricsInterceptor(info, metrics);
+    }
+};
+
+static void fill_histogram(const ShardedHistogram& histogram, HistogramSnapshot* snapshot) {
+    unique_ptr<LatencyHistogram> merged = histogram.Snapshot();
+    snapshot->set_count(merged->Count());
+    snapshot->set_mean(merged->Mean());
+    snapshot->set_p50(merged->Percentile(50));
+    snapshot->set_p90(merged->Percentile(90));
+    snapshot->set_p99(merged->Percentile(99));
+    snapshot->set_p999(merged->Percentile(99.9));
+    snapshot->set_max(merged->Max());
+}
+
+/** Holds a bulk stream slot for the lifetime of a transfer **/
+class BulkStreamGuard {
+
+private:
+    FairScheduler& scheduler;
+    string client_id;
+    bool admitted;
+
+public:
+    BulkStreamGuard(FairScheduler& scheduler, const string& client_id)
+        : scheduler(scheduler), client_id(client_id), admitted(scheduler.BeginBulk(client_id)) {}
+
+    ~BulkStreamGuard() {
+        if (admitted) {
+            scheduler.EndBulk(client_id);
+        }
+    }
+
+    bool Admitted() const {
+        return admitted;
+    }
+};
+
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
@@ -32,19 +171,395 @@ class DFSServiceImpl final :
         public DFSCallDataManager<FileRequestType , FileListResponseType> {
 
 private:
+    /** Per-RPC counters and latency histograms; declared first so master_m can time itself into them **/
+    unique_ptr<DFSMetrics> metrics{new_service_metrics()};
+
     /** Locked file names to client ID **/
     map<string, string> locked_files;
 
-    /** Main mutex for all file locks ID **/
-    mutex master_m;
+    /** Main mutex for all file locks ID; every acquisition is timed into the master_lock metrics **/
+    TimedMutex master_m{metrics->master_lock_wait, metrics->master_lock_hold};
 
     /** Mutex for accessing directory file list **/
     mutex directory_m;
 
+    /** Stub to the next server node in the replication chain, null on the tail **/
+    unique_ptr<DFSService::Stub> successor_stub;
+
+    /** Files with writes that have not yet been acknowledged by the tail, and how many **/
+    map<string, int> dirty_files;
+
+    /** Files whose last write or removal may not have reached the tail; read from the tail until rewritten **/
+    set<string> unreplicated_files;
+
+    /** Mutex for the dirty and unreplicated file sets **/
+    mutex chain_m;
+
+    /** Shared by the nodes of a chain; replication calls without it are refused **/
+    string chain_token;
+
+    /** Metadata/bulk QoS shared by all calls **/
+    unique_ptr<FairScheduler> scheduler{new FairScheduler()};
+
+    /** Early rejection of calls the server cannot finish in time **/
+    unique_ptr<AdmissionController> admission{new AdmissionController()};
+
+    /** Merkle tree over the files in the mount, walked by reconciling clients **/
+    Manifest manifest;
+
+    /** Where the manifest is persisted across restarts **/
+    string manifest_path;
+
+    /** Recycled chunk messages, so streaming allocates no buffer per chunk or per call **/
+    MessagePool<FileContext> file_chunks;
+    MessagePool<RangeChunk> range_chunks;
+
+    /** Bounds and tuning for the adaptive chunk size of outgoing streams **/
+    ChunkSizerOptions chunk_options;
+
+    /** Background Prometheus dump, stopped on shutdown **/
+    thread prometheus_thread;
+    atomic<bool> prometheus_stop{false};
+    mutex prometheus_m;
+    condition_variable prometheus_cv;
+
+    void RecordManifest(const string& filename) {
+        const string& full_path = WrapPath(filename);
+        struct stat file_stats;
+        if (stat(full_path.c_str(), &file_stats) != 0) {
+            manifest.Remove(filename);
+            return;
+        }
+
+        ManifestEntry entry;
+        entry.name = filename;
+        entry.size = file_stats.st_size;
+        entry.mtime = file_stats.st_mtime;
+        {
+            ScopedTimer crc_timer(metrics->crc);
+            entry.crc = dfs_file_checksum(full_path, &this->crc_table);
+        }
+        manifest.Upsert(entry);
+    }
+
+    // The retry hint is what tells clients to back off and retry instead of giving up
+    Status Shed(ServerContext* context, const string& reason, chrono::milliseconds retry_after) {
+        dfs_log(LL_DEBUG2) << "Shedding call from " << context->peer() << ": " << reason;
+        context->AddTrailingMetadata("retry-after-ms", to_string(retry_after.count()));
+        return Status(StatusCode::RESOURCE_EXHAUSTED, reason);
+    }
+
+    Status Shed(ServerContext* context, const AdmissionController::Ticket& ticket) {
+        return Shed(context, ticket.Reason(), ticket.RetryAfter());
+    }
+
+    // Stops disk work as soon as the client can no longer use the result
+    bool DeadlineExpired(ServerContext* context) {
+        return context->IsCancelled() || chrono::system_clock::now() > context->deadline();
+    }
+
+    // Clients identify themselves on transfers; fall back to the peer address otherwise
+    // Calls without a client ID in the request (ListFiles) carry it as dfs-client-id metadata instead;
+    // the peer address is the last resort, and changes with every connection
+    string ClientKey(ServerContext* context, const string& client_id) {
+        if (!client_id.empty()) {
+            return client_id;
+        }
+        const multimap<grpc::string_ref, grpc::string_ref>& metadata = context->client_metadata();
+        multimap<grpc::string_ref, grpc::string_ref>::const_iterator id = metadata.find("dfs-client-id");
+        if (id != metadata.end() && id->second.size() > 0) {
+            return string(id->second.data(), id->second.size());
+        }
+        return context->peer();
+    }
+
+    Status ReceiveChunks(ServerContext* context, ServerReader<FileContext>* reader, ofstream& ofs,
+                         const string& client_key, RpcMetrics& rpc) {
+        MessagePool<FileContext>::Lease content = file_chunks.Acquire();
+        while (reader->Read(content.get())) {
+            rpc.chunks.Add();
+            rpc.bytes_in.Add(content->chunk().size());
+            if (DeadlineExpired(context)) {
+                dfs_log(LL_ERROR) << "Deadline expired while receiving file";
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+            }
+            // Replication traffic passes an empty key and is not throttled
+            if (!client_key.empty() && !scheduler->AcquireBulk(client_key, content->chunk().size(), context->deadline())) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired waiting for bandwidth");
+            }
+            chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+            ofs.write(content->chunk().data(), content->chunk().size());
+            metrics->disk_write.RecordSince(write_start);
+        }
+
+        if (!ofs) {
+            return Status(StatusCode::INTERNAL, "Failed to write file");
+        }
+        return Status::OK;
+    }
+
+    Status SendChunks(ServerContext* context, ifstream& ifs, ServerWriter<FileContext>* writer,
+                      const string& client_key, RpcMetrics& rpc) {
+        // File data is read straight into the leased message's chunk buffer
+        MessagePool<FileContext>::Lease content = file_chunks.Acquire();
+        string& chunk = *content->mutable_chunk();
+        ChunkSizer sizer(chunk_options);
+        while (true) {
+            chunk.resize(sizer.Size());
+            chrono::steady_clock::time_point read_start = chrono::steady_clock::now();
+            ifs.read(&chunk[0], chunk.size());
+            metrics->disk_read.RecordSince(read_start);
+            streamsize bytes_read = ifs.gcount();
+            if (bytes_read <= 0) {
+                break;
+            }
+            chunk.resize(bytes_read);
+
+            if (DeadlineExpired(context)) {
+                dfs_log(LL_ERROR) << "Deadline expired while sending file";
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+            }
+            if (!scheduler->AcquireBulk(client_key, bytes_read, context->deadline())) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired waiting for bandwidth");
+            }
+            chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+            if (!writer->Write(*content)) {
+                return Status(StatusCode::CANCELLED, "Client stopped reading");
+            }
+            sizer.Record(bytes_read, chrono::steady_clock::now() - write_start);
+            metrics->chunk_size.Set(sizer.Size());
+            rpc.chunks.Add();
+            rpc.bytes_out.Add(bytes_read);
+        }
+        return Status::OK;
+    }
+
+    void MarkDirty(const string& filename) {
+        lock_guard<mutex> lock(chain_m);
+        ++dirty_files[filename];
+    }
+
+    void MarkClean(const string& filename) {
+        lock_guard<mutex> lock(chain_m);
+        map<string, int>::iterator it = dirty_files.find(filename);
+        if (it != dirty_files.end() && --it->second == 0) {
+            dirty_files.erase(it);
+        }
+    }
+
+    /** Records whether the latest write of a file is known to have reached the tail **/
+    void MarkReplicated(const string& filename, bool replicated) {
+        lock_guard<mutex> lock(chain_m);
+        if (replicated) {
+            unreplicated_files.erase(filename);
+        } else {
+            unreplicated_files.insert(filename);
+        }
+    }
+
+    // Compared without an early exit so the token cannot be guessed byte by byte from response times
+    bool FromPredecessor(ServerContext* context) {
+        const multimap<grpc::string_ref, grpc::string_ref>& metadata = context->client_metadata();
+        multimap<grpc::string_ref, grpc::string_ref>::const_iterator token = metadata.find("dfs-chain-token");
+        if (chain_token.empty() || token == metadata.end() || token->second.size() != chain_token.size()) {
+            return false;
+        }
+        unsigned char difference = 0;
+        for (size_t i = 0; i < chain_token.size(); ++i) {
+            difference |= token->second.data()[i] ^ chain_token[i];
+        }
+        return difference == 0;
+    }
+
+    /** Keeps a file marked dirty for the lifetime of one write, whichever way it ends **/
+    class DirtyMark {
+
+    private:
+        DFSServiceImpl* service;
+        string filename;
+
+    public:
+        DirtyMark(DFSServiceImpl* service, const string& filename) : service(service), filename(filename) {
+            service->MarkDirty(filename);
+        }
+
+        ~DirtyMark() {
+            service->MarkClean(filename);
+        }
+    };
+
+    // The tail always holds committed data; other replicas only serve files with no write in flight
+    // and whose last write is known to have reached the tail
+    bool ServesRead(const string& filename) {
+        lock_guard<mutex> lock(chain_m);
+        return !successor_stub || (dirty_files.count(filename) == 0 && unreplicated_files.count(filename) == 0);
+    }
+
+    bool ServesListing() {
+        lock_guard<mutex> lock(chain_m);
+        return !successor_stub || (dirty_files.empty() && unreplicated_files.empty());
+    }
+
+    Status ForwardFile(ServerContext* context, const FileContext& file_metadata, const string& full_path) {
+        if (!successor_stub) {
+            return Status::OK;
+        }
+
+        unique_ptr<ClientContext> forward_context = ClientContext::FromServerContext(*context);
+        forward_context->AddMetadata("dfs-chain-token", chain_token);
+        FileContext response;
+        unique_ptr<ClientWriter<FileContext>> writer = successor_stub->ReplicateFile(forward_context.get(), &response);
+
+        dfs_log(LL_DEBUG2) << "Forwarding file '" << file_metadata.metadata().name() << "' down the chain";
+        if (!writer->Write(file_metadata)) {
+            dfs_log(LL_ERROR) << "Could not send file metadata to successor";
+            return Status(StatusCode::UNAVAILABLE, "Successor unreachable");
+        }
+
+        ifstream ifs(full_path, ios::binary);
+        if (!ifs.is_open()) {
+            dfs_log(LL_ERROR) << "Failed to open file '" << full_path << "' for replication";
+            return Status(StatusCode::INTERNAL, "Failed to open file for replication");
+        }
+
+        MessagePool<FileContext>::Lease content = file_chunks.Acquire();
+        string& chunk = *content->mutable_chunk();
+        ChunkSizer sizer(chunk_options);
+        while (true) {
+            chunk.resize(sizer.Size());
+            ifs.read(&chunk[0], chunk.size());
+            if (ifs.gcount() <= 0) {
+                break;
+            }
+            chunk.resize(ifs.gcount());
+            chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+            if (!writer->Write(*content)) {
+                break;
+            }
+            sizer.Record(chunk.size(), chrono::steady_clock::now() - write_start);
+            metrics->chunk_size.Set(sizer.Size());
+        }
+        ifs.close();
+
+        writer->WritesDone();
+        return writer->Finish();
+    }
+
+    Status ForwardRemove(ServerContext* context, const FileContext& request) {
+        if (!successor_stub) {
+            return Status::OK;
+        }
+
+        unique_ptr<ClientContext> forward_context = ClientContext::FromServerContext(*context);
+        forward_context->AddMetadata("dfs-chain-token", chain_token);
+        Blank response;
+        dfs_log(LL_DEBUG2) << "Forwarding removal of '" << request.metadata().name() << "' down the chain";
+        return successor_stub->ReplicateRemove(forward_context.get(), request, &response);
+    }
+
+    /**
+     * Forwards a sealed file down the chain and moves it into place only once
+     * the successor acknowledged it, so this node never serves data the tail
+     * lacks. If anything fails after forwarding began, the tail may hold
+     * either version, and reads of the file go to the tail until it is
+     * written again.
+     */
+    Status CommitReplicated(ServerContext* context, const FileContext& file_metadata, StagedFile& staged) {
+        const string& filename = file_metadata.metadata().name();
+        MarkReplicated(filename, false);
+
+        Status chain_result = ForwardFile(context, file_metadata, staged.TempPath());
+        if (!chain_result.ok()) {
+            dfs_log(LL_ERROR) << "Replicating '" << filename << "' failed: " << chain_result.error_message();
+            return chain_result;
+        }
+        if (!staged.Commit()) {
+            dfs_log(LL_ERROR) << "Failed to move '" << filename << "' into place";
+            return Status(StatusCode::INTERNAL, "Failed to store file");
+        }
+
+        MarkReplicated(filename, true);
+        this->RecordManifest(filename);
+        return Status::OK;
+    }
+
 public:
 
     ~DFSServiceImpl() {
         this->runner.Shutdown();
+        if (!manifest_path.empty() && manifest.Unsaved()) {
+            manifest.Save(manifest_path);
+        }
+        if (prometheus_thread.joinable()) {
+            {
+                lock_guard<mutex> lock(prometheus_m);
+                prometheus_stop = true;
+            }
+            prometheus_cv.notify_all();
+            prometheus_thread.join();
+        }
+    }
+
+    /** Interceptors to install on the ServerBuilder so every call is counted **/
+    vector<unique_ptr<ServerInterceptorFactoryInterface>> MetricsInterceptors() {
+        vector<unique_ptr<ServerInterceptorFactoryInterface>> factories;
+        factories.emplace_back(new MetricsInterceptorFactory(metrics.get()));
+        return factories;
+    }
+
+    /** Rewrites `path` with all metrics in Prometheus text format every `interval` **/
+    void EnablePrometheusDump(const string& path, chrono::seconds interval) {
+        prometheus_thread = thread([this, path, interval]() {
+            unique_lock<mutex> lock(prometheus_m);
+            while (!prometheus_cv.wait_for(lock, interval, [this] { return prometheus_stop.load(); })) {
+                if (!metrics->WritePrometheus(path)) {
+                    dfs_log(LL_ERROR) << "Failed to write metrics to " << path;
+                }
+            }
+        });
+    }
+
+    void LoadManifest(const string& path) {
+        manifest_path = path;
+        manifest.Load(manifest_path);
+        manifest.Refresh(mount_path, [this](const string& file_path) {
+            return dfs_file_checksum(file_path, &this->crc_table);
+        });
+        if (manifest.Unsaved()) {
+            manifest.Save(manifest_path);
+        }
+        dfs_log(LL_SYSINFO) << "Loaded manifest " << manifest_path;
+    }
+
+    void ConfigureAdmission(const AdmissionOptions& options) {
+        admission.reset(new AdmissionController(options));
+    }
+
+    void ConfigureScheduler(const SchedulerOptions& options) {
+        scheduler.reset(new FairScheduler(options));
+    }
+
+    void ConfigureChunkSizing(const ChunkSizerOptions& options) {
+        chunk_options = options;
+        file_chunks.ReserveChunks(options.max_chunk);
+        range_chunks.ReserveChunks(options.max_chunk);
+    }
+
+    void SetClientWeight(const string& client_id, double weight) {
+        scheduler->SetClientWeight(client_id, weight);
+    }
+
+    /** Secret shared by every node of the chain, required on ReplicateFile and ReplicateRemove **/
+    void SetChainToken(const string& token) {
+        chain_token = token;
+    }
+
+    void SetSuccessor(const string& address) {
+        if (chain_token.empty()) {
+            dfs_log(LL_ERROR) << "No chain token set; the successor will refuse replicated writes";
+        }
+        dfs_log(LL_SYSINFO) << "Replicating writes to successor " << address;
+        successor_stub = DFSService::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
     }
 
     Status GetWriteLock(ServerContext* context, const FileContext* request, Blank* response) override {
@@ -53,6 +568,15 @@ public:
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");   
         }
 
+        chrono::milliseconds retry_after(0);
+        if (!scheduler->AdmitMetadata(ClientKey(context, request->metadata().client_id()), &retry_after)) {
+            return Shed(context, "Metadata rate limit exceeded", retry_after);
+        }
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::METADATA, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
         // Redacted lock checkout
 
         dfs_log(LL_DEBUG2) << "Client " << request->metadata().client_id() << " locked file '" << request->metadata().name() << "'";
@@ -61,7 +585,6 @@ public:
     }
 
     Status ReleaseWriteLock(ServerContext* context, const FileContext* request, Blank* response) override {
-        
         // Redacted lock return
 
         return Status(StatusCode::FAILED_PRECONDITION, "Trying to unlock file that client does not have access to");
@@ -80,18 +603,117 @@ public:
             return Status(StatusCode::INVALID_ARGUMENT, "Metadata not received");
         }
 
+        // Clients built against the old int32 field report files of 2 GiB and up as negative; treat those as unknown
+        long declared_size = max<long>(client_file.metadata().size(), 0);
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::TRANSFER, context->deadline(), declared_size);
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
         // Redacted pre-condition validation
 
+        string client_key = ClientKey(context, client_file.metadata().client_id());
+        BulkStreamGuard bulk_stream(*scheduler, client_key);
+        if (!bulk_stream.Admitted()) {
+            return Shed(context, "Too many concurrent transfers", scheduler->BulkRetryAfter());
+        }
+
         dfs_log(LL_SYSINFO) << "Storing file '" << client_file.metadata().name() << "'";
-        ofstream ofs(full_path, ios::binary);
-        if (!ofs.is_open()) {
+        DirtyMark dirty(this, client_file.metadata().name());
+        StagedFile staged(full_path);
+        if (!staged.IsOpen()) {
+            dfs_log(LL_ERROR) << "Failed to open file '" << full_path << "' for writing";
+            return Status(StatusCode::INTERNAL, "Failed to open file for writing");
+        }
+
+        Status transfer_result = ReceiveChunks(context, reader, staged.stream, client_key, metrics->Rpc("UploadFile"));
+        if (!transfer_result.ok()) {
+            return transfer_result;
+        }
+
+        // The head stamps the client's mtime too, so every node in the chain reports the same one
+        if (!staged.Seal(client_file.metadata().last_modified())) {
+            dfs_log(LL_ERROR) << "Failed to store file '" << full_path << "'";
+            return Status(StatusCode::INTERNAL, "Failed to store file");
+        }
+        return this->CommitReplicated(context, client_file, staged);
+    }
+
+    Status ReplicateFile(ServerContext* context, ServerReader<FileContext>* reader, FileContext* response) override {
+        dfs_log(LL_DEBUG2) << "Entering ReplicateFile";
+        if (context->IsCancelled()){
+            dfs_log(LL_ERROR) << "Deadline expired";
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+        }
+
+        if (!this->FromPredecessor(context)) {
+            return Status(StatusCode::PERMISSION_DENIED, "Replication is only accepted from the predecessor");
+        }
+
+        FileContext file_metadata;
+        if (!reader->Read(&file_metadata)) {
+            dfs_log(LL_ERROR) << "Metadata not received";
+            return Status(StatusCode::INVALID_ARGUMENT, "Metadata not received");
+        }
+
+        const string& filename = file_metadata.metadata().name();
+        const string& full_path = WrapPath(filename);
+        DirtyMark dirty(this, filename);
+
+        dfs_log(LL_SYSINFO) << "Storing replica of '" << filename << "'";
+        StagedFile staged(full_path);
+        if (!staged.IsOpen()) {
             dfs_log(LL_ERROR) << "Failed to open file '" << full_path << "' for writing";
             return Status(StatusCode::INTERNAL, "Failed to open file for writing");
         }
 
-        // Redacted file storage
+        Status transfer_result = ReceiveChunks(context, reader, staged.stream, "", metrics->Rpc("ReplicateFile"));
+        if (!transfer_result.ok()) {
+            return transfer_result;
+        }
 
-        ofs.close();
+        // Keep mtimes identical along the chain so clients compare equal against any replica
+        if (!staged.Seal(file_metadata.metadata().last_modified())) {
+            dfs_log(LL_ERROR) << "Failed to store replica '" << full_path << "'";
+            return Status(StatusCode::INTERNAL, "Failed to store file");
+        }
+
+        Status commit_result = this->CommitReplicated(context, file_metadata, staged);
+        if (commit_result.ok()) {
+            get_file_status(full_path, response);
+        }
+        return commit_result;
+    }
+
+    Status ReplicateRemove(ServerContext* context, const FileContext* request, Blank* response) override {
+        dfs_log(LL_DEBUG2) << "Entering ReplicateRemove";
+        if (context->IsCancelled()) {
+            dfs_log(LL_ERROR) << "Deadline expired";
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+        }
+
+        if (!this->FromPredecessor(context)) {
+            return Status(StatusCode::PERMISSION_DENIED, "Replication is only accepted from the predecessor");
+        }
+
+        const string& filename = request->metadata().name();
+        const string& full_path = WrapPath(filename);
+        DirtyMark dirty(this, filename);
+
+        // Successors drop the file first, so no replica lacks a file that the tail still serves
+        MarkReplicated(filename, false);
+        Status chain_result = ForwardRemove(context, *request);
+        if (!chain_result.ok()) {
+            dfs_log(LL_ERROR) << "Replicating removal of '" << full_path << "' failed: " << chain_result.error_message();
+            return chain_result;
+        }
+
+        if (remove(full_path.c_str()) != 0 && errno != ENOENT) {
+            dfs_log(LL_ERROR) << "Failed to remove replica '" << full_path << "'";
+            return Status(StatusCode::INTERNAL, "Failed to remove file");
+        }
+        MarkReplicated(filename, true);
+        manifest.Remove(filename);
         return Status::OK;
     }
 
@@ -102,6 +724,16 @@ public:
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
         }
 
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::TRANSFER, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
+        if (!this->ServesRead(request->metadata().name())) {
+            dfs_log(LL_DEBUG2) << "Write to '" << request->metadata().name() << "' still in flight, redirecting to tail";
+            return Status(StatusCode::UNAVAILABLE, "Replica is not up to date");
+        }
+
         const string& full_path = WrapPath(request->metadata().name());
         FileContext server_stats;
         if (!get_file_status(full_path, &server_stats)) {
@@ -110,6 +742,12 @@ public:
 
         // Redacted pre-condition validation
 
+        string client_key = ClientKey(context, request->metadata().client_id());
+        BulkStreamGuard bulk_stream(*scheduler, client_key);
+        if (!bulk_stream.Admitted()) {
+            return Shed(context, "Too many concurrent transfers", scheduler->BulkRetryAfter());
+        }
+
         dfs_log(LL_SYSINFO) << "Sending file '" << full_path << "'";
 
         ifstream ifs(full_path, ios::binary);
@@ -118,15 +756,200 @@ public:
             return Status(StatusCode::INTERNAL, "Failed to open file");
         }
 
-        // Redacted sending file chunks
+        // Metadata goes first, so the client can stamp the server's mtime on its copy
+        if (!writer->Write(server_stats)) {
+            return Status(StatusCode::CANCELLED, "Client stopped reading");
+        }
 
+        Status transfer_result = SendChunks(context, ifs, writer, client_key, metrics->Rpc("DownloadFile"));
         ifs.close();
+        return transfer_result;
+    }
+
+    Status ReadRange(ServerContext* context, const RangeRequest* request, ServerWriter<RangeChunk>* writer) override {
+        dfs_log(LL_DEBUG2) << "Entering ReadRange";
+        if (context->IsCancelled()){
+            dfs_log(LL_ERROR) << "Deadline expired";
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+        }
+
+        if (request->ranges_size() > MAX_RANGES_PER_CALL) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Too many ranges in one request");
+        }
+
+        if (!this->ServesRead(request->name())) {
+            return Status(StatusCode::UNAVAILABLE, "Replica is not up to date");
+        }
+
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::TRANSFER, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
+        string client_key = ClientKey(context, request->client_id());
+        BulkStreamGuard bulk_stream(*scheduler, client_key);
+        if (!bulk_stream.Admitted()) {
+            return Shed(context, "Too many concurrent transfers", scheduler->BulkRetryAfter());
+        }
+
+        const string& full_path = WrapPath(request->name());
+        int fd = open(full_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return Status(StatusCode::NOT_FOUND, "File does not exist");
+        }
+
+        struct stat file_stats;
+        if (fstat(fd, &file_stats) != 0) {
+            close(fd);
+            dfs_log(LL_ERROR) << "Failed to stat '" << full_path << "'";
+            return Status(StatusCode::INTERNAL, "Failed to stat file");
+        }
+
+        RpcMetrics& rpc = metrics->Rpc("ReadRange");
+        MessagePool<RangeChunk>::Lease content = range_chunks.Acquire();
+        string& buffer = *content->mutable_chunk();
+        ChunkSizer sizer(chunk_options);
+        for (int i = 0; i < request->ranges_size(); ++i) {
+            const ByteRange& range = request->ranges(i);
+            if (range.offset() < 0 || range.length() < 0) {
+                close(fd);
+                return Status(StatusCode::INVALID_ARGUMENT, "Negative range offset or length");
+            }
+
+            // Ranges are clamped to the end of the file; a range past it yields no chunks
+            // Compared against the bytes left so a huge offset plus length cannot overflow
+            int64_t end = file_stats.st_size;
+            if (range.length() > 0 && range.offset() < end && range.length() < end - range.offset()) {
+                end = range.offset() + range.length();
+            }
+
+            dfs_log(LL_DEBUG3) << "Reading '" << request->name() << "' [" << range.offset() << ", " << end << ")";
+            for (int64_t offset = range.offset(); offset < end; ) {
+                if (DeadlineExpired(context)) {
+                    close(fd);
+                    return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+                }
+
+                buffer.resize(min<int64_t>(sizer.Size(), end - offset));
+                chrono::steady_clock::time_point read_start = chrono::steady_clock::now();
+                ssize_t bytes_read = pread(fd, &buffer[0], buffer.size(), offset);
+                metrics->disk_read.RecordSince(read_start);
+                if (bytes_read <= 0) {
+                    close(fd);
+                    dfs_log(LL_ERROR) << "Failed to read '" << full_path << "' at offset " << offset;
+                    return Status(StatusCode::INTERNAL, "Failed to read file");
+                }
+                buffer.resize(bytes_read);
+                if (!scheduler->AcquireBulk(client_key, bytes_read, context->deadline())) {
+                    close(fd);
+                    return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired waiting for bandwidth");
+                }
+
+                content->set_range_index(i);
+                content->set_offset(offset);
+                chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+                if (!writer->Write(*content)) {
+                    close(fd);
+                    return Status(StatusCode::CANCELLED, "Client stopped reading");
+                }
+                sizer.Record(bytes_read, chrono::steady_clock::now() - write_start);
+                metrics->chunk_size.Set(sizer.Size());
+                rpc.chunks.Add();
+                rpc.bytes_out.Add(bytes_read);
+                offset += bytes_read;
+            }
+        }
+
+        close(fd);
+        return Status::OK;
+    }
+
+    Status GetManifest(ServerContext* context, const ManifestQuery* request, ManifestReply* response) override {
+        dfs_log(LL_DEBUG2) << "Entering GetManifest";
+        if (context->IsCancelled()) {
+            dfs_log(LL_ERROR) << "Deadline expired";
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline expired");
+        }
+        if (!this->ServesListing()) {
+            return Status(StatusCode::UNAVAILABLE, "Replica is not up to date");
+        }
+
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::METADATA, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
+        response->set_root(manifest.Root());
+        for (const ManifestNode& node : request->nodes()) {
+            if (node.level() < 0 || node.level() > Manifest::DEPTH || node.index() < 0 || node.index() >= Manifest::Width(node.level())) {
+                return Status(StatusCode::INVALID_ARGUMENT, "Manifest node out of range");
+            }
+
+            if (node.level() == Manifest::DEPTH) {
+                for (const ManifestEntry& entry : manifest.BucketEntries(node.index())) {
+                    MetaData* file = response->add_files();
+                    file->set_name(entry.name);
+                    file->set_size(entry.size);
+                    file->set_last_modified(entry.mtime);
+                    file->set_crc(entry.crc);
+                }
+                continue;
+            }
+
+            for (int child = node.index() * Manifest::FANOUT; child < (node.index() + 1) * Manifest::FANOUT; ++child) {
+                ManifestNode* child_node = response->add_nodes();
+                child_node->set_level(node.level() + 1);
+                child_node->set_index(child);
+                child_node->set_hash(manifest.NodeHash(node.level() + 1, child));
+            }
+        }
+        return Status::OK;
+    }
+
+    Status GetStats(ServerContext* context, const Blank* request, StatsReply* response) override {
+        for (const pair<const string, unique_ptr<RpcMetrics>>& rpc : metrics->Rpcs()) {
+            RpcStats* stats = response->add_rpcs();
+            stats->set_method(rpc.first);
+            stats->set_calls(rpc.second->calls.Value());
+            stats->set_errors(rpc.second->errors.Value());
+            stats->set_bytes_in(rpc.second->bytes_in.Value());
+            stats->set_bytes_out(rpc.second->bytes_out.Value());
+            stats->set_chunks(rpc.second->chunks.Value());
+            fill_histogram(rpc.second->latency, stats->mutable_latency_us());
+        }
+
+        for (const pair<string, const ShardedHistogram*>& timer : metrics->Timers()) {
+            TimerStats* stats = response->add_timers();
+            stats->set_name(timer.first);
+            fill_histogram(*timer.second, stats->mutable_latency_us());
+        }
+
+        for (const pair<string, const Gauge*>& gauge : metrics->Gauges()) {
+            GaugeStats* stats = response->add_gauges();
+            stats->set_name(gauge.first);
+            stats->set_value(gauge.second->Value());
+        }
+#ifdef DFS_COUNT_ALLOCATIONS
+        response->set_counts_allocations(true);
+        response->set_heap_allocations(heap_allocations.Value());
+#endif
         return Status::OK;
     }
 
     Status ListFiles(ServerContext* context, const Blank* request, FileCatalog* response) override {
         dfs_log(LL_DEBUG2) << "Listing files";
-        
+        if (!this->ServesListing()) {
+            return Status(StatusCode::UNAVAILABLE, "Replica is not up to date");
+        }
+        chrono::milliseconds retry_after(0);
+        if (!scheduler->AdmitMetadata(ClientKey(context, ""), &retry_after)) {
+            return Shed(context, "Metadata rate limit exceeded", retry_after);
+        }
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::METADATA, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
         DIR *dir = opendir(mount_path.c_str());
         if (!dir) {
             dfs_log(LL_ERROR) << "Failed to open directory " << mount_path;
@@ -135,6 +958,9 @@ public:
 
         struct dirent* entry;
         while ((entry = readdir(dir)) != nullptr) {
+            if (is_staged_file(entry->d_name)) {
+                continue;
+            }
             // Redacted file iteration
         }
 
@@ -153,6 +979,18 @@ public:
             return Status(StatusCode::INVALID_ARGUMENT, "Missing request metadata");
         }
 
+        if (!this->ServesRead(request->metadata().name())) {
+            return Status(StatusCode::UNAVAILABLE, "Replica is not up to date");
+        }
+        chrono::milliseconds retry_after(0);
+        if (!scheduler->AdmitMetadata(ClientKey(context, request->metadata().client_id()), &retry_after)) {
+            return Shed(context, "Metadata rate limit exceeded", retry_after);
+        }
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::METADATA, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
         response->mutable_metadata()->set_name(request->metadata().name());
         const string& full_path = WrapPath(request->metadata().name());
         if (!get_file_status(full_path, response)) {
@@ -173,10 +1011,28 @@ public:
             return Status(StatusCode::INVALID_ARGUMENT, "Missing request metadata");
         }
 
+        AdmissionController::Ticket ticket = admission->Admit(AdmissionController::METADATA, context->deadline());
+        if (!ticket.Admitted()) {
+            return Shed(context, ticket);
+        }
+
         string full_path = WrapPath(request->metadata().name());
-        
+        DirtyMark dirty(this, request->metadata().name());
+
+        // Redacted pre-condition validation
+
+        // Successors drop the file first; until this node has too, its reads go to the tail
+        MarkReplicated(request->metadata().name(), false);
+        Status chain_result = ForwardRemove(context, *request);
+        if (!chain_result.ok()) {
+            dfs_log(LL_ERROR) << "Replicating removal of '" << full_path << "' failed";
+            return chain_result;
+        }
+
         // Redacted file removal
-        
+
+        MarkReplicated(request->metadata().name(), true);
+        manifest.Remove(request->metadata().name());
         return Status::OK;
     }
 
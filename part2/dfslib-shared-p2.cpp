@@ -1,11 +1,221 @@
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include <string>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <ctime>
+#include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <cstddef>
 #include <sys/stat.h>
 
+#include "dfslib-log-p2.h"
+
 dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 
+/**
+ * Owns every log ring and the thread that drains them.
+ *
+ * Rings are handed out to threads and returned when a thread exits, so the
+ * number of rings stays at the largest number of threads that were logging
+ * at once. Records left in a returned ring are still drained. When every
+ * ring is empty the drain thread sleeps on a condition variable. Producers
+ * only take the wake mutex while it is asleep, so a busy logger never
+ * touches it.
+ */
+class DFSLogDrain {
+
+private:
+    vector<unique_ptr<DFSLogRing>> rings;
+    vector<DFSLogRing*> free_rings;
+    mutex rings_m;
+
+    /** Serializes consumers so each ring keeps a single reader **/
+    mutex drain_m;
+
+    mutex wake_m;
+    condition_variable wake_cv;
+    atomic<bool> sleeping{false};
+    bool wake = false;
+    bool stop = false;
+    thread worker;
+
+    static const char* LevelName(int level) {
+        switch (level) {
+            case LL_ERROR: return "ERROR";
+            case LL_SYSINFO: return "SYSINFO";
+            case LL_DEBUG2: return "DEBUG2";
+            case LL_DEBUG3: return "DEBUG3";
+            default: return "DEBUG";
+        }
+    }
+
+    static void Format(const DFSLogEntry& entry, string* out) {
+        time_t seconds = entry.timestamp_us / 1000000;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        char prefix[64];
+        size_t length = strftime(prefix, sizeof(prefix), "[%Y-%m-%d %H:%M:%S", &local);
+        snprintf(prefix + length, sizeof(prefix) - length, ".%06ld] ", static_cast<long>(entry.timestamp_us % 1000000));
+
+        out->append(prefix);
+        out->append(LevelName(entry.level));
+        out->append(" ");
+        out->append(entry.file);
+        out->append(":");
+        out->append(to_string(entry.line));
+        out->append(" ");
+        out->append(entry.text, entry.length);
+        out->append("\n");
+    }
+
+    /** Writes out everything queued so far; returns whether anything was written **/
+    bool DrainOnce() {
+        lock_guard<mutex> drain_lock(drain_m);
+        string batch;
+        DFSLogEntry entry;
+        {
+            lock_guard<mutex> lock(rings_m);
+            for (unique_ptr<DFSLogRing>& ring : rings) {
+                while (ring->Pop(&entry)) {
+                    Format(entry, &batch);
+                }
+                uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+                if (dropped > 0) {
+                    batch.append("[dfs_log] dropped " + to_string(dropped) + " records, ring full\n");
+                }
+            }
+        }
+
+        if (batch.empty()) {
+            return false;
+        }
+        fwrite(batch.data(), 1, batch.size(), stderr);
+        fflush(stderr);
+        return true;
+    }
+
+    bool Pending() {
+        lock_guard<mutex> lock(rings_m);
+        for (unique_ptr<DFSLogRing>& ring : rings) {
+            if (!ring->Empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run() {
+        unique_lock<mutex> lock(wake_m);
+        while (!stop) {
+            lock.unlock();
+            bool drained = DrainOnce();
+            lock.lock();
+            if (drained) {
+                continue;
+            }
+
+            // Pairs with the fence in Wake: either this look sees the record or the producer sees the flag
+            sleeping.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!Pending()) {
+                wake_cv.wait(lock, [this] { return wake || stop; });
+            }
+            wake = false;
+            sleeping.store(false, memory_order_relaxed);
+        }
+        lock.unlock();
+        DrainOnce();
+    }
+
+public:
+    DFSLogDrain() : worker(&DFSLogDrain::Run, this) {}
+
+    ~DFSLogDrain() {
+        {
+            lock_guard<mutex> lock(wake_m);
+            stop = true;
+        }
+        wake_cv.notify_one();
+        worker.join();
+    }
+
+    DFSLogRing* Acquire() {
+        lock_guard<mutex> lock(rings_m);
+        if (!free_rings.empty()) {
+            DFSLogRing* ring = free_rings.back();
+            free_rings.pop_back();
+            return ring;
+        }
+        rings.emplace_back(new DFSLogRing());
+        return rings.back().get();
+    }
+
+    /** Takes back the ring of an exiting thread; the next thread to log reuses it **/
+    void Release(DFSLogRing* ring) {
+        lock_guard<mutex> lock(rings_m);
+        free_rings.push_back(ring);
+    }
+
+    /** Called after every push; cheap unless the drain thread is asleep **/
+    void Wake() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!sleeping.load(memory_order_relaxed)) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(wake_m);
+            wake = true;
+        }
+        wake_cv.notify_one();
+    }
+
+    void Flush() {
+        while (DrainOnce()) {}
+    }
+};
+
+static DFSLogDrain& dfs_log_drain() {
+    static DFSLogDrain drain;
+    return drain;
+}
+
+/** Holds the calling thread's ring and returns it to the drain when the thread exits **/
+class DFSLogRingOwner {
+
+private:
+    DFSLogRing* ring;
+
+public:
+    DFSLogRingOwner() : ring(dfs_log_drain().Acquire()) {}
+
+    ~DFSLogRingOwner() {
+        dfs_log_drain().Release(ring);
+    }
+
+    DFSLogRing& Ring() {
+        return *ring;
+    }
+};
+
+DFSLogRing& dfs_log_ring() {
+    static thread_local DFSLogRingOwner owner;
+    return owner.Ring();
+}
+
+void dfs_log_submit(const DFSLogEntry& entry) {
+    if (dfs_log_ring().Push(entry)) {
+        dfs_log_drain().Wake();
+    }
+}
+
+void dfs_log_flush() {
+    dfs_log_drain().Flush();
+}
+
 bool get_file_status(string path, FileContext* response) {
     // Redacted metadata updates
 }
\ No newline at end of file
@@ -0,0 +1,107 @@
+#ifndef DFSLIB_STAGED_P2_H
+#define DFSLIB_STAGED_P2_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+/** Name prefix of files still being received; listings and manifests skip them **/
+const char STAGED_FILE_PREFIX[] = ".dfs-staged-";
+
+inline bool is_staged_file(const std::string& name) {
+    return name.compare(0, sizeof(STAGED_FILE_PREFIX) - 1, STAGED_FILE_PREFIX) == 0;
+}
+
+/**
+ * Receives a file under a temporary name next to its destination, or in
+ * `staging_dir` if one is given. That directory must be on the same file
+ * system as the destination, or the rename in Commit fails.
+ *
+ * Seal flushes the data and stamps its mtime; Commit then renames it over
+ * the destination, which readers see complete or not at all. Between the
+ * two, the sealed data can be read from TempPath, e.g. to replicate it
+ * before it becomes visible. A StagedFile destroyed without a
+ * successful Commit removes its temporary file, so a transfer that fails or
+ * is cancelled halfway leaves the previous copy untouched.
+ */
+class StagedFile {
+
+private:
+    std::string path;
+    std::string temp_path;
+    bool committed = false;
+
+public:
+    std::ofstream stream;
+
+    explicit StagedFile(const std::string& path, const std::string& staging_dir = "") : path(path) {
+        std::string::size_type slash = path.rfind('/');
+        std::string directory = staging_dir.empty() ? path.substr(0, slash == std::string::npos ? 0 : slash + 1) : staging_dir + "/";
+        std::string pattern = directory + STAGED_FILE_PREFIX + "XXXXXX";
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+
+        int fd = mkstemp(name.data());
+        if (fd < 0) {
+            return;
+        }
+        // mkstemp creates the file private to the owner; stored files are world readable
+        fchmod(fd, 0644);
+        close(fd);
+
+        temp_path = name.data();
+        stream.open(temp_path, std::ios::binary | std::ios::trunc);
+    }
+
+    StagedFile(const StagedFile&) = delete;
+    StagedFile& operator=(const StagedFile&) = delete;
+
+    ~StagedFile() {
+        if (!committed && !temp_path.empty()) {
+            stream.close();
+            unlink(temp_path.c_str());
+        }
+    }
+
+    bool IsOpen() const {
+        return stream.is_open();
+    }
+
+    /** Where the data is received until Commit **/
+    const std::string& TempPath() const {
+        return temp_path;
+    }
+
+    /** Flushes the data and sets its mtime, leaving it under the temporary name **/
+    bool Seal(int64_t mtime) {
+        stream.close();
+        if (!stream) {
+            return false;
+        }
+
+        struct utimbuf times;
+        times.actime = mtime;
+        times.modtime = mtime;
+        return utime(temp_path.c_str(), &times) == 0;
+    }
+
+    /** Moves sealed data into place **/
+    bool Commit() {
+        if (rename(temp_path.c_str(), path.c_str()) != 0) {
+            return false;
+        }
+        committed = true;
+        return true;
+    }
+
+    bool Commit(int64_t mtime) {
+        return Seal(mtime) && Commit();
+    }
+};
+
+#endif